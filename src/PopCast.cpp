@@ -84,6 +84,7 @@ TCasterParams MakeCasterParams(Unity::uint ParamBits,const char* Filename,float
 	Params.mGifParams.mDebugTransparency = HasBit(ParamBits, TPluginParams::Gif_DebugTransparency);
 	Params.mGifParams.mCpuOnly = HasBit(ParamBits, TPluginParams::Gif_CpuOnly);
 	Params.mGifParams.mLzwCompression = HasBit(ParamBits, TPluginParams::Gif_LzwCompression);
+	Params.mGifParams.mFrameRate = FrameRate;
 
 	//	gr: this is here to make gif stuff simpler
 	//	force watermark palette
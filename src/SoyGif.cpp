@@ -8,6 +8,12 @@
 #include <SoyJson.h>
 
 #include "gif.h"
+#include "SoyGifSimd.h"
+#include "SoyGifLookup.h"
+#include "SoyGifJobPool.h"
+#include "SoyGifPool.h"
+#include "SoyGifGovernor.h"
+#include "SoyGifRing.h"
 
 
 
@@ -20,9 +26,20 @@ namespace Gif
 	static uint64		TimerMinMs = 1000;
 	
 	void	MakeIndexedImage(SoyPixelsImpl& IndexedImage,const SoyPixelsImpl& Rgba);
-	void	MaskImage(SoyPixelsImpl& RgbaMutable,const SoyPixelsImpl& PrevRgb,bool& Keyframe,bool TestAlpha,const TEncodeParams& Params,TMaskPixelFunc MaskPixelFunc);
+	void	MaskImage(SoyPixelsImpl& RgbaMutable,const SoyPixelsImpl& PrevRgb,bool& Keyframe,TDirtyRect& ChangedRect,size_t& ChangedPixelCount,bool TestAlpha,const TEncodeParams& Params);
+	void	CropImage(SoyPixelsImpl& Cropped,const SoyPixelsImpl& Source,const TDirtyRect& Rect);
+	void	CopyWithAlpha(SoyPixelsImpl& Rgba,const SoyPixelsImpl& Rgb);
+	bool	GetDownscaleSize(size_t& Width,size_t& Height,const TEncodeParams& Params);
+	void	HalveImage(SoyPixelsImpl& Halved,const SoyPixelsImpl& Source);
+	void	ResizeImage(SoyPixelsImpl& Resized,const SoyPixelsImpl& Source);
 	void	GetPalette(SoyPixelsImpl& Palette,const SoyPixelsImpl& Rgba,const TEncodeParams& Params,bool& IsKeyframe);
-	void	ShrinkPalette(SoyPixelsImpl& Palette,bool Sort,const TEncodeParams& Params);
+	void	GetHistogramPalette(SoyPixelsImpl& Palette,const SoyPixelsImpl& Rgba,const TEncodeParams& Params);
+	bool	GetExactPalette(SoyPixelsImpl& Palette,SoyPixelsImpl& IndexedImage,const SoyPixelsImpl& Rgba,const TEncodeParams& Params);
+	void	ShrinkPalette(SoyPixelsImpl& Palette,bool Sort,const TEncodeParams& Params,TTaskPool& Tasks);
+	void	SortPaletteByUse(SoyPixelsImpl& Palette,SoyPixelsImpl& IndexedImage,size_t TransparentIndex);
+	bool	IsSamePalette(const SoyPixelsImpl& a,const SoyPixelsImpl& b);
+	bool	GetPaletteDrift(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Source,size_t PixelSkip,size_t& MeanDiff,size_t& MaxDiff);
+	void	GetIndexedDrift(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Indexes,const SoyPixelsImpl& Source,size_t TransparentIndex,size_t PixelSkip,size_t& MeanDiff,size_t& MaxDiff);
 }
 
 
@@ -56,32 +73,68 @@ std::shared_ptr<TMediaEncoder> Gif::AllocEncoder(std::shared_ptr<TMediaPacketBuf
 	return Encoder;
 }
 
-
-float GetColourScore(const vec3x<uint8>& a,const vec3x<uint8>& b)
+std::shared_ptr<TMediaEncoder> Gif::AllocEncoder(std::shared_ptr<TMediaPacketBuffer> OutputBuffer,size_t StreamIndex,const TEncodeParams& Params,bool SkipFrames)
 {
-	vec3x<int> Diff;
-	Diff.x = abs(b.x - a.x);
-	Diff.y = abs(b.y - a.y);
-	Diff.z = abs(b.z - a.z);
-	float Score = 1.0 - ( ( Diff.x + Diff.y + Diff.z) / 3.0f );
-	return Score;
+	std::shared_ptr<TMediaEncoder> Encoder( new TEncoder( OutputBuffer, StreamIndex, Params, SkipFrames ) );
+	return Encoder;
 }
 
 
-size_t FindNearestColour(const vec3x<uint8>& rgb,const SoyPixelsImpl& Palette)
+Gif::TPixelLayout::TPixelLayout(SoyPixelsFormat::Type Format) :
+	mChannels	( 4 ),
+	mRed		( 0 ),
+	mGreen		( 1 ),
+	mBlue		( 2 ),
+	mHasAlpha	( true )
 {
-	size_t Index = 0;
-	float Score = 999.f;
-	for ( int i = 0; i < Palette.GetWidth(); i++ )
+	switch ( Format )
 	{
-		auto Pal = Palette.GetPixel3(0, 0);
-		auto PalScore = GetColourScore(rgb, Pal);
-		if ( PalScore > Score )
-			continue;
-		Score = PalScore;
-		Index = i;
+		case SoyPixelsFormat::RGBA:
+			break;
+
+		case SoyPixelsFormat::BGRA:
+			mRed = 2;
+			mBlue = 0;
+			break;
+
+		case SoyPixelsFormat::RGB:
+			mChannels = 3;
+			mHasAlpha = false;
+			break;
+
+		case SoyPixelsFormat::BGR:
+			mChannels = 3;
+			mHasAlpha = false;
+			mRed = 2;
+			mBlue = 0;
+			break;
+
+		default:
+			throw Soy::AssertException( std::string("Gif encoder can't read pixel format ") + SoyPixelsFormat::ToString(Format) );
+	}
+}
+
+bool Gif::TPixelLayout::IsSupported(SoyPixelsFormat::Type Format)
+{
+	switch ( Format )
+	{
+		case SoyPixelsFormat::RGBA:
+		case SoyPixelsFormat::BGRA:
+		case SoyPixelsFormat::RGB:
+		case SoyPixelsFormat::BGR:
+			return true;
+
+		default:
+			return false;
 	}
-	return Index;
+}
+
+
+TCpuGifBlitter::TCpuGifBlitter(size_t IndexLookupBits,std::shared_ptr<Gif::TPixelsPool> PixelsPool) :
+	mLookupCache	( new Gif::TIndexLookupCache(IndexLookupBits) ),
+	mPixelsPool		( PixelsPool )
+{
+	Soy::Assert( mPixelsPool != nullptr, "TCpuGifBlitter expects pixels pool" );
 }
 
 
@@ -91,27 +144,255 @@ std::shared_ptr<SoyPixelsImpl> TCpuGifBlitter::IndexImageWithShader(std::shared_
 	Soy::Assert(Source != nullptr, "Expected Source");
 	Soy::Assert(JobSempahore != nullptr, "Expected Semaphore");
 
-	std::shared_ptr<SoyPixelsImpl> pIndexedImage( new SoyPixels );
-	auto& IndexedImage = *pIndexedImage;
-	IndexedImage.Init( Source->GetWidth(), Source->GetHeight(), SoyPixelsFormat::Greyscale);
+	auto pIndexedImage = mPixelsPool->Alloc( SoyPixelsMeta( Source->GetWidth(), Source->GetHeight(), SoyPixelsFormat::Greyscale ) );
+	IndexImage( *Palette, *Source, *pIndexedImage );
+
+	JobSempahore->OnCompleted();
+	return pIndexedImage;
+}
+
+
+void TCpuGifBlitter::IndexImage(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Source,SoyPixelsImpl& IndexedImage)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
 
-	//	brute force
-	for ( int y = 0; y < IndexedImage.GetHeight(); y++ )
+	//	matches the shaders
+	static const uint8 TransparentIndex = 0;
+
+	auto Width = Source.GetWidth();
+	auto Height = Source.GetHeight();
+	Gif::TPixelLayout Layout( Source.GetFormat() );
+	auto Channels = Layout.mChannels;
+	bool HasAlpha = Layout.mHasAlpha;
+
+	IndexedImage.Init( Width, Height, SoyPixelsFormat::Greyscale );
+
+	Gif::TIndexPalette IndexPalette;
+	IndexPalette.Init( Palette, TransparentIndex );
+	auto IndexRow = Gif::GetIndexRowFunc( Gif::GetSimdLevel() );
+
+	//	building a table costs about as much as searching for as many pixels as it has cells, so only
+	//	build for images bigger than that. Cached tables are always used
+	std::shared_ptr<Gif::TIndexLookupTable> LookupTable;
+	if ( !IndexPalette.IsEmpty() )
+	{
+		bool AllowBuild = ( Width * Height ) >= mLookupCache->GetCellCount();
+		LookupTable = mLookupCache->GetTable( IndexPalette, IndexRow, AllowBuild );
+	}
+	if ( LookupTable )
+	{
+		IndexImage( *LookupTable, Source, IndexedImage );
+		return;
+	}
+
+	//	row scratch, unique runs of opaque pixels are compacted into these for the simd kernels.
+	//	per thread as frames can be indexed on several threads at once, and kept to save allocating every frame
+	auto PaddedWidth = ( (Width + Gif::SimdPixelAlign-1) / Gif::SimdPixelAlign ) * Gif::SimdPixelAlign;
+	static thread_local Array<uint16> RowRed;
+	static thread_local Array<uint16> RowGreen;
+	static thread_local Array<uint16> RowBlue;
+	static thread_local Array<uint32> RowMapArray;		//	x -> compacted index
+	static thread_local Array<uint8> RowIndexArray;
+	RowRed.SetSize( PaddedWidth );
+	RowGreen.SetSize( PaddedWidth );
+	RowBlue.SetSize( PaddedWidth );
+	RowMapArray.SetSize( PaddedWidth );
+	RowIndexArray.SetSize( PaddedWidth );
+	auto* Red = RowRed.GetArray();
+	auto* Green = RowGreen.GetArray();
+	auto* Blue = RowBlue.GetArray();
+	auto* RowMap = RowMapArray.GetArray();
+	auto* RowIndexes = RowIndexArray.GetArray();
+	static const uint32 TransparentMap = ~0u;
+
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	auto* IndexPixels = IndexedImage.GetPixelsArray().GetArray();
+
+	for ( size_t y=0;	y<Height;	y++ )
 	{
-		for ( int x = 0; x < IndexedImage.GetWidth(); x++ )
+		auto* SourceRow = &SourcePixels[ y * Width * Channels ];
+		auto* IndexRowOut = &IndexPixels[ y * Width ];
+
+		//	transparent (masked) pixels skip the kernel, and runs of the same colour only go in once
+		size_t UniqueCount = 0;
+		for ( size_t x=0;	x<Width;	x++ )
+		{
+			auto* Pixel = &SourceRow[ x * Channels ];
+			if ( HasAlpha && Pixel[3] == 0 )
+			{
+				RowMap[x] = TransparentMap;
+				continue;
+			}
+
+			auto r = Pixel[Layout.mRed];
+			auto g = Pixel[Layout.mGreen];
+			auto b = Pixel[Layout.mBlue];
+			auto Last = UniqueCount-1;
+			if ( UniqueCount > 0 && Red[Last] == r && Green[Last] == g && Blue[Last] == b )
+			{
+				RowMap[x] = size_cast<uint32>( Last );
+				continue;
+			}
+
+			Red[UniqueCount] = r;
+			Green[UniqueCount] = g;
+			Blue[UniqueCount] = b;
+			RowMap[x] = size_cast<uint32>( UniqueCount );
+			UniqueCount++;
+		}
+
+		//	palette with only the transparent colour leaves everything transparent
+		if ( UniqueCount > 0 && !IndexPalette.IsEmpty() )
+			IndexRow( IndexPalette, Red, Green, Blue, RowIndexes, UniqueCount );
+
+		for ( size_t x=0;	x<Width;	x++ )
 		{
-			float xf = x / (float)IndexedImage.GetWidth();
-			float yf = y / (float)IndexedImage.GetHeight();
-			int sx = xf * Source->GetWidth();
-			int sy = yf * Source->GetHeight();
-			auto rgb = Source->GetPixel3(sx, sy);
-			auto Index = FindNearestColour(rgb, *Palette);
-			IndexedImage.SetPixel(x, y, 0, Index);
+			auto Map = RowMap[x];
+			bool Transparent = ( Map == TransparentMap ) || IndexPalette.IsEmpty();
+			IndexRowOut[x] = Transparent ? TransparentIndex : RowIndexes[Map];
 		}
 	}
+}
 
-	JobSempahore->OnCompleted();
-	return pIndexedImage;
+
+//	error (sum of abs rgb differences) of sampled opaque pixels against their nearest palette colour.
+//	Always the exact search, batched through the row kernel, so it matches what the palette's frames would get.
+//	true if every pixel was checked (rather than sampled)
+bool Gif::GetPaletteDrift(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Source,size_t PixelSkip,size_t& MeanDiff,size_t& MaxDiff)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+
+	static const uint8 TransparentIndex = 0;
+	//	small rects get every pixel checked, it's cheap and a skip could miss the only changed pixels
+	static const size_t SampleAllPixelCount = 64*64;
+	static const size_t BatchSize = SimdPixelAlign * 16;
+
+	MeanDiff = 0;
+	MaxDiff = 0;
+
+	TPixelLayout Layout( Source.GetFormat() );
+	auto Channels = Layout.mChannels;
+	bool HasAlpha = Layout.mHasAlpha;
+
+	TIndexPalette IndexPalette;
+	IndexPalette.Init( Palette, TransparentIndex );
+	if ( IndexPalette.IsEmpty() )
+	{
+		MeanDiff = MaxDiff = 255*3;
+		return false;
+	}
+
+	auto IndexRow = GetIndexRowFunc( GetSimdLevel() );
+	GIF_ALIGN(32) uint16 Red[BatchSize];
+	GIF_ALIGN(32) uint16 Green[BatchSize];
+	GIF_ALIGN(32) uint16 Blue[BatchSize];
+	GIF_ALIGN(32) uint8 Indexes[BatchSize];
+	size_t BatchCount = 0;
+
+	size_t TotalDiff = 0;
+	size_t SampleCount = 0;
+	auto FlushBatch = [&]
+	{
+		if ( BatchCount == 0 )
+			return;
+		IndexRow( IndexPalette, Red, Green, Blue, Indexes, BatchCount );
+		for ( size_t b=0;	b<BatchCount;	b++ )
+		{
+			auto Index = Indexes[b];
+			size_t Diff = abs( Red[b] - IndexPalette.mRed[Index] ) + abs( Green[b] - IndexPalette.mGreen[Index] ) + abs( Blue[b] - IndexPalette.mBlue[Index] );
+			TotalDiff += Diff;
+			MaxDiff = std::max( MaxDiff, Diff );
+		}
+		SampleCount += BatchCount;
+		BatchCount = 0;
+	};
+
+	auto PixelCount = Source.GetWidth() * Source.GetHeight();
+	auto PixelStep = ( PixelCount <= SampleAllPixelCount ) ? 1 : std::max<size_t>( 1, PixelSkip );
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	for ( size_t i=0;	i<PixelCount;	i+=PixelStep )
+	{
+		auto* Pixel = &SourcePixels[ i * Channels ];
+		if ( HasAlpha && Pixel[3] == 0 )
+			continue;
+
+		Red[BatchCount] = Pixel[Layout.mRed];
+		Green[BatchCount] = Pixel[Layout.mGreen];
+		Blue[BatchCount] = Pixel[Layout.mBlue];
+		BatchCount++;
+		if ( BatchCount == BatchSize )
+			FlushBatch();
+	}
+	FlushBatch();
+
+	if ( SampleCount > 0 )
+		MeanDiff = TotalDiff / SampleCount;
+	return PixelStep == 1;
+}
+
+
+//	same as GetPaletteDrift, but against the indexes a frame was given, so there's no searching
+void Gif::GetIndexedDrift(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Indexes,const SoyPixelsImpl& Source,size_t TransparentIndex,size_t PixelSkip,size_t& MeanDiff,size_t& MaxDiff)
+{
+	static const size_t SampleAllPixelCount = 64*64;
+
+	MeanDiff = 0;
+	MaxDiff = 0;
+
+	TPixelLayout Layout( Source.GetFormat() );
+	auto Channels = Layout.mChannels;
+	bool HasAlpha = Layout.mHasAlpha;
+	auto PaletteChannels = Palette.GetChannels();
+	auto PaletteSize = Palette.GetWidth();
+	auto* PalettePixels = Palette.GetPixelsArray().GetArray();
+	auto* IndexPixels = Indexes.GetPixelsArray().GetArray();
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	Soy::Assert( Indexes.GetWidth() == Source.GetWidth() && Indexes.GetHeight() == Source.GetHeight(), "Indexed image doesn't match its source" );
+
+	auto PixelCount = Source.GetWidth() * Source.GetHeight();
+	auto PixelStep = ( PixelCount <= SampleAllPixelCount ) ? 1 : std::max<size_t>( 1, PixelSkip );
+	size_t TotalDiff = 0;
+	size_t SampleCount = 0;
+	for ( size_t i=0;	i<PixelCount;	i+=PixelStep )
+	{
+		auto* Pixel = &SourcePixels[ i * Channels ];
+		auto Index = IndexPixels[i];
+		if ( ( HasAlpha && Pixel[3] == 0 ) || Index == TransparentIndex || Index >= PaletteSize )
+			continue;
+
+		auto* Colour = &PalettePixels[ Index * PaletteChannels ];
+		size_t Diff = abs( Pixel[Layout.mRed] - Colour[0] ) + abs( Pixel[Layout.mGreen] - Colour[1] ) + abs( Pixel[Layout.mBlue] - Colour[2] );
+		TotalDiff += Diff;
+		MaxDiff = std::max( MaxDiff, Diff );
+		SampleCount++;
+	}
+
+	if ( SampleCount > 0 )
+		MeanDiff = TotalDiff / SampleCount;
+}
+
+
+void TCpuGifBlitter::IndexImage(const Gif::TIndexLookupTable& LookupTable,const SoyPixelsImpl& Source,SoyPixelsImpl& IndexedImage)
+{
+	static const uint8 TransparentIndex = 0;
+
+	auto PixelCount = Source.GetWidth() * Source.GetHeight();
+	Gif::TPixelLayout Layout( Source.GetFormat() );
+	auto Channels = Layout.mChannels;
+	bool HasAlpha = Layout.mHasAlpha;
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	auto* IndexPixels = IndexedImage.GetPixelsArray().GetArray();
+
+	for ( size_t i=0;	i<PixelCount;	i++ )
+	{
+		auto* Pixel = &SourcePixels[ i * Channels ];
+		if ( HasAlpha && Pixel[3] == 0 )
+		{
+			IndexPixels[i] = TransparentIndex;
+			continue;
+		}
+		IndexPixels[i] = LookupTable.GetIndex( Pixel[Layout.mRed], Pixel[Layout.mGreen], Pixel[Layout.mBlue] );
+	}
 }
 
 
@@ -305,8 +586,20 @@ Gif::TMuxer::TMuxer(std::shared_ptr<TStreamWriter>& Output,std::shared_ptr<TMedi
 	TMediaMuxer		( Output, Input, std::string("Gif::TMuxer ")+ThreadName ),
 	mFinished		( false ),
 	mStarted		( false ),
-	mLzwCompression	( Params.mLzwCompression )
+	mLzwCompression	( Params.mLzwCompression ),
+	mGlobalPaletteEnabled	( Params.mGlobalPalette ),
+	mParams			( Params ),
+	mHeaderWritten	( false ),
+	mWrittenDelay	( 0 ),
+	mFrameCount		( 0 ),
+	mFailedFrameCount	( 0 ),
+	mDroppingUntilKeyframe	( false ),
+	mHeaderSize		( 0 ),
+	mWrittenSize	( 0 )
 {
+	//	let a few frames queue per thread so workers don't go idle waiting for the next packet
+	auto MaxPendingJobs = Params.mLzwThreadCount * 2;
+	mLzwJobs.reset( new TOrderedJobPool( "Gif::TMuxer Lzw", Params.mLzwThreadCount, MaxPendingJobs ) );
 }
 
 Gif::TMuxer::~TMuxer()
@@ -318,6 +611,9 @@ Gif::TMuxer::~TMuxer()
 	}
 	mBusy.unlock();
 	WaitToFinish();
+
+	//	drop any frames still compressing
+	mLzwJobs.reset();
 }
 
 void Gif::TMuxer::Finish()
@@ -330,6 +626,28 @@ void Gif::TMuxer::Finish()
 		return;
 	
 	mFinished = true;
+
+	//	last frame has nothing after it, so it lasts as long as the frames before it did on average
+	if ( mHeldPacket )
+	{
+		auto EndTimecode = mHeldPacket->mTimecode;
+		auto ElapsedMs = std::max<int64_t>( 0, mHeldPacket->mTimecode.GetDiff( mFirstTimecode ) );
+		if ( mFrameCount > 1 )
+			EndTimecode += SoyTime( std::chrono::milliseconds( ElapsedMs / ( mFrameCount - 1 ) ) );
+		else if ( mParams.mFrameRate > 0 )
+			EndTimecode += SoyTime( std::chrono::milliseconds( 1000 / mParams.mFrameRate ) );
+		else
+			EndTimecode += mHeldPacket->mDuration;
+		WriteFrame( mHeldPacket, GetHeldFrameDelay( EndTimecode ) );
+		mHeldPacket.reset();
+	}
+
+	//	no frames
+	if ( !mHeaderWritten )
+		WriteHeader( nullptr );
+
+	//	footer goes after every frame
+	mLzwJobs->Flush();
 	
 	std::shared_ptr<Soy::TWriteProtocol> FooterWrite( new TRawWriteDataProtocol );
 	Array<char>& HeaderData = dynamic_cast<TRawWriteDataProtocol&>( *FooterWrite ).mData;
@@ -364,7 +682,7 @@ void Gif::TMuxer::Finish()
 
 	GifEnd( Writer );
 	
-	mOutput->Push( FooterWrite );
+	PushWrite( FooterWrite, false );
 }
 
 
@@ -379,6 +697,23 @@ void Gif::TMuxer::SetupStreams(const ArrayBridge<TStreamMeta>&& Streams)
 		return;
 	}
 	
+	//	header is written with the first frame, so its palette can be the global colour table
+	mCanvasMeta = Streams[0].mPixelMeta;
+
+	//	the encoder downscales frames before they get here
+	auto Width = mCanvasMeta.GetWidth();
+	auto Height = mCanvasMeta.GetHeight();
+	if ( GetDownscaleSize( Width, Height, mParams ) )
+		mCanvasMeta = SoyPixelsMeta( Width, Height, mCanvasMeta.GetFormat() );
+	
+	mStarted = true;
+}
+
+
+void Gif::TMuxer::WriteHeader(const SoyPixelsImpl* GlobalPalette)
+{
+	Soy::Assert( !mHeaderWritten, "Gif header already written" );
+
 	std::shared_ptr<Soy::TWriteProtocol> HeaderWrite( new TRawWriteDataProtocol );
 	Array<char>& HeaderData = dynamic_cast<TRawWriteDataProtocol&>( *HeaderWrite ).mData;
 	
@@ -407,15 +742,74 @@ void Gif::TMuxer::SetupStreams(const ArrayBridge<TStreamMeta>&& Streams)
 	Writer.fputs = Puts;
 	Writer.fwrite = fwrite;
 
-	auto PixelMeta = Streams[0].mPixelMeta;
 	static uint16 LoopCount = 0;
-	auto Width = size_cast<uint16>( PixelMeta.GetWidth() );
-	auto Height = size_cast<uint16>( PixelMeta.GetHeight() );
-	GifBegin( Writer, Width, Height, LoopCount );
+	auto Width = size_cast<uint16>( mCanvasMeta.GetWidth() );
+	auto Height = size_cast<uint16>( mCanvasMeta.GetHeight() );
+	GifBegin( Writer, Width, Height, LoopCount, GlobalPalette );
 
-	mOutput->Push( HeaderWrite );
-	
-	mStarted = true;
+	PushWrite( HeaderWrite, false );
+	mHeaderWritten = true;
+
+	std::lock_guard<std::mutex> Lock( mKeyframeOffsetsLock );
+	mHeaderSize = mWrittenSize;
+}
+
+
+void Gif::TMuxer::PushWrite(std::shared_ptr<Soy::TWriteProtocol> Write,bool Keyframe)
+{
+	auto& Data = dynamic_cast<TRawWriteDataProtocol&>( *Write ).mData;
+	{
+		std::lock_guard<std::mutex> Lock( mKeyframeOffsetsLock );
+		if ( Keyframe )
+			mKeyframeOffsets.PushBack( mWrittenSize );
+		mWrittenSize += Data.GetSize();
+	}
+	mOutput->Push( Write );
+}
+
+
+size_t Gif::TMuxer::GetKeyframeOffsets(ArrayBridge<size_t>&& Offsets)
+{
+	std::lock_guard<std::mutex> Lock( mKeyframeOffsetsLock );
+	Offsets.Copy( mKeyframeOffsets );
+	return mHeaderSize;
+}
+
+
+void Gif::TMuxer::GetMeta(TJsonWriter& Json)
+{
+	TMediaMuxer::GetMeta( Json );
+
+	Json.Push("FailedFrameCount", mFailedFrameCount.load() );
+
+	std::lock_guard<std::mutex> Lock( mKeyframeOffsetsLock );
+	Json.Push("HeaderBytes", mHeaderSize );
+	Json.Push("KeyframeCount", mKeyframeOffsets.GetSize() );
+	if ( !mKeyframeOffsets.IsEmpty() )
+		Json.Push("LastKeyframeOffset", mKeyframeOffsets.GetBack() );
+}
+
+
+void Gif::TMuxer::SetEncoder(std::shared_ptr<TMediaEncoder> Encoder)
+{
+	std::lock_guard<std::mutex> Lock( mEncoderLock );
+	mEncoder = std::dynamic_pointer_cast<TEncoder>( Encoder );
+}
+
+
+bool Gif::IsSamePalette(const SoyPixelsImpl& a,const SoyPixelsImpl& b)
+{
+	if ( &a == &b )
+		return true;
+	if ( a.GetWidth() != b.GetWidth() )
+		return false;
+
+	for ( size_t i=0;	i<a.GetWidth();	i++ )
+	{
+		if ( a.GetPixel3( i, 0 ) != b.GetPixel3( i, 0 ) )
+			return false;
+	}
+	return true;
 }
 
 
@@ -449,44 +843,84 @@ void Gif::TMuxer::ProcessPacket(std::shared_ptr<TMediaPacket> Packet,TStreamWrit
 		return;
 	}
 
-	SoyPixelsDef<Array<uint8>> PalettisedImage( Packet->mData, Packet->mMeta.mPixelMeta );
+	auto PixelFormat = Packet->mMeta.mPixelMeta.GetFormat();
 	Soy::Assert( Packet->mMeta.mCodec == SoyMediaFormat::Palettised_RGB_8 || Packet->mMeta.mCodec == SoyMediaFormat::Palettised_RGBA_8, "Expected palettised image as codec");
-	Soy::Assert( PalettisedImage.GetFormat() == SoyPixelsFormat::Palettised_RGB_8 || PalettisedImage.GetFormat() == SoyPixelsFormat::Palettised_RGBA_8, "Expected palettised image in pixel meta");
+	Soy::Assert( PixelFormat == SoyPixelsFormat::Palettised_RGB_8 || PixelFormat == SoyPixelsFormat::Palettised_RGBA_8, "Expected palettised image in pixel meta");
 	
-	SoyTime FinalDuration;
-
-	if ( mPrevImageTimecode.IsValid() )
-	{
-		auto Diff = Packet->mTimecode.GetDiff(mPrevImageTimecode);
-		FinalDuration.mTime = std::abs(Diff);
-	}
+	//	frames are held until the next one arrives, so the delay covers the time until it, including any unchanged
+	//	frames the encoder dropped in between, rather than each frame costing bytes to show nothing new
+	if ( mHeldPacket )
+		WriteFrame( mHeldPacket, GetHeldFrameDelay( Packet->mTimecode ) );
 	else
-	{
-		FinalDuration = Packet->mDuration;
-	}
+		mFirstTimecode = Packet->mTimecode;
+
+	mHeldPacket = Packet;
+	mFrameCount++;
+}
 
+
+uint16 Gif::TMuxer::GetHeldFrameDelay(SoyTime NextTimecode)
+{
 	//	ms to 100th's
 	//	https://bugzilla.mozilla.org/show_bug.cgi?id=232822
 	//	in chrome, 1(10ms) turns into 100ms
-	static uint16 MinDurationMs = 20;
-	auto delay = std::max( MinDurationMs, size_cast<uint16>( FinalDuration.GetTime() ) ) / 10;
-	
-	//	gr: looks like it's going a little funny, so cap it too
-	static uint16 MaxDurationMs = 1000 / 20;
-	delay = std::min<uint16>( delay * 10, MaxDurationMs ) / 10;
+	static size_t MinDelay = 20 / 10;
+	static size_t MaxDelay = 0xffff;
+
+	//	delays are measured from the first frame, so rounding each one to 10ms doesn't make playback drift, and an
+	//	occasional frame padded up to the minimum is made up by the next. The encoder doesn't send frames closer
+	//	than the minimum on average, or written time would keep running ahead
+	auto EndMs = std::max<int64_t>( 0, NextTimecode.GetDiff( mFirstTimecode ) );
+	auto EndDelay = static_cast<size_t>( ( EndMs + 5 ) / 10 );
+	size_t Delay = ( EndDelay > mWrittenDelay ) ? EndDelay - mWrittenDelay : 0;
+	Delay = std::min( std::max( Delay, MinDelay ), MaxDelay );
+
+	mWrittenDelay += Delay;
+	return size_cast<uint16>( Delay );
+}
 
 
+void Gif::TMuxer::WriteFrame(std::shared_ptr<TMediaPacket> Packet,uint16 Delay)
+{
+	//	only the changed rect of the canvas is encoded
+	uint16 Left = 0;
+	uint16 Top = 0;
+	auto FrameBuffer = std::dynamic_pointer_cast<TFrameBuffer>( Packet->mPixelBuffer );
+	if ( FrameBuffer )
+	{
+		Left = size_cast<uint16>( FrameBuffer->mRect.mLeft );
+		Top = size_cast<uint16>( FrameBuffer->mRect.mTop );
+	}
+
+	//	first frame's palette becomes the global colour table, frames with the same palette then don't need their own
+	std::shared_ptr<SoyPixelsImpl> FramePalette;
+	if ( FrameBuffer && FrameBuffer->HasPlanes() )
+		FramePalette = FrameBuffer->mPalette;
+
+	if ( !mHeaderWritten )
+	{
+		if ( mGlobalPaletteEnabled && FramePalette )
+			mGlobalPalette = FramePalette;
+		WriteHeader( mGlobalPalette.get() );
+	}
+
+	std::shared_ptr<SoyPixelsImpl> GlobalPalette;
+	if ( mGlobalPalette && FramePalette && IsSamePalette( *mGlobalPalette, *FramePalette ) )
+		GlobalPalette = mGlobalPalette;
+
+	//	each frame's lzw stream is independent, so compress on the pool and output in the order they came in
+	std::shared_ptr<Soy::TWriteProtocol> LzwWrite( new TRawWriteDataProtocol );
+	auto LzwCompression = mLzwCompression;
+	auto Compress = [Packet,FrameBuffer,GlobalPalette,LzwWrite,Left,Top,Delay,LzwCompression]
 	{
 		GifWriter LzwWriter;
-		
-		std::shared_ptr<Soy::TWriteProtocol> LzwWrite( new TRawWriteDataProtocol );
 		Array<char>& LzwData = dynamic_cast<TRawWriteDataProtocol&>( *LzwWrite ).mData;
 
-		auto Putc = [this,&LzwData](uint8 c)
+		auto Putc = [&LzwData](uint8 c)
 		{
 			LzwData.PushBack(c);
 		};
-		auto Puts = [this,&LzwData](const char* s)
+		auto Puts = [&LzwData](const char* s)
 		{
 			size_t Size = 0;
 			while ( s[Size] )
@@ -495,7 +929,7 @@ void Gif::TMuxer::ProcessPacket(std::shared_ptr<TMediaPacket> Packet,TStreamWrit
 			auto Data = GetRemoteArray( s, Size );
 			LzwData.PushBackArray( Data );
 		};
-		auto fwrite = [this,&LzwData](uint8* Buffer,size_t Length)
+		auto fwrite = [&LzwData](uint8* Buffer,size_t Length)
 		{
 			auto Data = GetRemoteArray( reinterpret_cast<const char*>(Buffer), Length );
 			LzwData.PushBackArray( Data );
@@ -505,24 +939,78 @@ void Gif::TMuxer::ProcessPacket(std::shared_ptr<TMediaPacket> Packet,TStreamWrit
 		LzwWriter.fputs = Puts;
 		LzwWriter.fwrite = fwrite;
 		
-		
+		//	our encoder gives us the planes, otherwise unpack them
 		BufferArray<std::shared_ptr<SoyPixelsImpl>,2> PaletteAndIndexed;
-		PalettisedImage.SplitPlanes( GetArrayBridge(PaletteAndIndexed) );
-		
-		size_t PaletteSize,TransparentIndex;
-		SoyPixelsFormat::GetHeaderPalettised( GetArrayBridge( PalettisedImage.GetPixelsArray() ), PaletteSize, TransparentIndex );
+		size_t TransparentIndex = 0;
+		if ( FrameBuffer && FrameBuffer->HasPlanes() )
+		{
+			PaletteAndIndexed.PushBack( FrameBuffer->mPalette );
+			PaletteAndIndexed.PushBack( FrameBuffer->mIndexes );
+			TransparentIndex = FrameBuffer->mTransparentIndex;
+		}
+		else
+		{
+			SoyPixelsDef<Array<uint8>> PalettisedImage( Packet->mData, Packet->mMeta.mPixelMeta );
+			PalettisedImage.SplitPlanes( GetArrayBridge(PaletteAndIndexed) );
+
+			size_t PaletteSize;
+			SoyPixelsFormat::GetHeaderPalettised( GetArrayBridge( PalettisedImage.GetPixelsArray() ), PaletteSize, TransparentIndex );
+		}
 		
 		auto& IndexedImage = *PaletteAndIndexed[1];
-		auto& Palette = *PaletteAndIndexed[0];
+		auto* pPalette = PaletteAndIndexed[0].get();
 		
+		bool LocalPalette = ( GlobalPalette == nullptr );
+
+		//	a local colour table only needs the colours this frame uses, and frames using a few of the global table's may be
+		//	better off with their own small one. The palette may be shared, so this makes a new one
+		SoyPixels CompactPalette;
+		size_t MaxIndex;
+		if ( GifCompactPalette( CompactPalette, IndexedImage, *pPalette, size_cast<uint8>( TransparentIndex ), !LocalPalette, MaxIndex ) )
+		{
+			pPalette = &CompactPalette;
+			LocalPalette = true;
+		}
+		auto& Palette = *pPalette;
+
 		//	fastish ~7ms
 		Soy::TScopeTimerPrint Timer("GifWriteLzwImage", Gif::TimerMinMs );
-		GifWriteLzwImage( LzwWriter, IndexedImage, 0, 0, delay, Palette, TransparentIndex, mLzwCompression );
-		
-		Output.Push( LzwWrite );
+		GifWriteLzwImage( LzwWriter, IndexedImage, Left, Top, Delay, Palette, LocalPalette, TransparentIndex, MaxIndex, LzwCompression );
+	};
+
+	//	whole canvas with nothing transparent, so decoding can start here
+	bool Keyframe = Packet->mIsKeyFrame;
+	if ( FrameBuffer )
+	{
+		Keyframe = Keyframe && FrameBuffer->mRect.mWidth == mCanvasMeta.GetWidth();
+		Keyframe = Keyframe && FrameBuffer->mRect.mHeight == mCanvasMeta.GetHeight();
 	}
+
+	//	frames after a failed one are deltas against it, so they're dropped until the encoder's resync keyframe.
+	//	Their time is lost, the delays have already gone into the frames before
+	auto Write = [this,LzwWrite,Keyframe]
+	{
+		if ( mDroppingUntilKeyframe && !Keyframe )
+		{
+			mFailedFrameCount++;
+			return;
+		}
+		mDroppingUntilKeyframe = false;
+		PushWrite( LzwWrite, Keyframe );
+	};
+
+	auto Failed = [this](const std::string& Error)
+	{
+		mFailedFrameCount++;
+		mDroppingUntilKeyframe = true;
+
+		std::lock_guard<std::mutex> Lock( mEncoderLock );
+		auto Encoder = mEncoder.lock();
+		if ( Encoder )
+			Encoder->Resync();
+	};
 	
-	mPrevImageTimecode = Packet->mTimecode;
+	mLzwJobs->Push( Compress, Write, Failed );
 
 	static bool DebugFin = false;
 	if ( DebugFin )
@@ -534,11 +1022,37 @@ Gif::TEncoder::TEncoder(std::shared_ptr<TMediaPacketBuffer>& OutputBuffer,size_t
 	SoyWorkerThread		( "Gif::TEncoder", SoyWorkerWaitMode::Wake ),
 	TMediaEncoder		( OutputBuffer ),
 	mStreamIndex		( StreamIndex ),
+	mPixelsPool			( new TPixelsPool ),
+	mQualityGovernor	( Params.mAdaptiveQuality ? new TQualityGovernor( Params.mFrameRate, Params.mPalettiseThreadCount ) : nullptr ),
 	mOpenglGifBlitter	( new Opengl::GifBlitter(Context,TexturePool) ),
+	mCpuGifBlitter		( new TCpuGifBlitter(Params.mIndexLookupBits,mPixelsPool) ),
 	mParams				( Params ),
 	mPushedFrameCount	( 0 ),
-	mSkipFrames			( SkipFrames )
+	mExactPaletteFrameCount	( 0 ),
+	mReusedPaletteFrameCount	( 0 ),
+	mUnchangedFrameCount	( 0 ),
+	mFailedFrameCount	( 0 ),
+	mDecimatedFrameCount	( 0 ),
+	mDroppedNewestFrameCount	( 0 ),
+	mDroppedOldestFrameCount	( 0 ),
+	mThinnedFrameCount	( 0 ),
+	mBlockTimeoutFrameCount	( 0 ),
+	mChangedPixelCount	( 0 ),
+	mIndexMaskedPixelCount	( 0 ),
+	mMaskedFrameCount	( 0 ),
+	mKeyframeMasked		( false ),
+	mResyncPending		( false ),
+	mDroppingUntilResync	( false ),
+	mLastKeyframeIndex	( 0 ),
+	mSkipFrames			( SkipFrames ),
+	mFrameRateStarted	( false ),
+	mFrameRateNextFrame	( 0 ),
+	mQueueKeepCounter	( 0 ),
+	mReusePaletteMeanDiff	( 0 ),
+	mReusePaletteMaxDiff	( 0 )
 {
+	AllocPendingFrames();
+	AllocPalettiseJobs();
 	Start();
 }
 
@@ -547,13 +1061,39 @@ Gif::TEncoder::TEncoder(std::shared_ptr<TMediaPacketBuffer>& OutputBuffer,size_t
 	SoyWorkerThread		( "Gif::TEncoder", SoyWorkerWaitMode::Wake ),
 	TMediaEncoder		( OutputBuffer ),
 	mStreamIndex		( StreamIndex ),
+	mPixelsPool			( new TPixelsPool ),
+	mQualityGovernor	( Params.mAdaptiveQuality ? new TQualityGovernor( Params.mFrameRate, Params.mPalettiseThreadCount ) : nullptr ),
 #if defined(ENABLE_DIRECTX)
 	mDirectxGifBlitter	( new Directx::GifBlitter(Context,TexturePool) ),
 #endif
+	mCpuGifBlitter		( new TCpuGifBlitter(Params.mIndexLookupBits,mPixelsPool) ),
 	mParams				( Params ),
 	mPushedFrameCount	( 0 ),
-	mSkipFrames			( SkipFrames )
+	mExactPaletteFrameCount	( 0 ),
+	mReusedPaletteFrameCount	( 0 ),
+	mUnchangedFrameCount	( 0 ),
+	mFailedFrameCount	( 0 ),
+	mDecimatedFrameCount	( 0 ),
+	mDroppedNewestFrameCount	( 0 ),
+	mDroppedOldestFrameCount	( 0 ),
+	mThinnedFrameCount	( 0 ),
+	mBlockTimeoutFrameCount	( 0 ),
+	mChangedPixelCount	( 0 ),
+	mIndexMaskedPixelCount	( 0 ),
+	mMaskedFrameCount	( 0 ),
+	mKeyframeMasked		( false ),
+	mResyncPending		( false ),
+	mDroppingUntilResync	( false ),
+	mLastKeyframeIndex	( 0 ),
+	mSkipFrames			( SkipFrames ),
+	mFrameRateStarted	( false ),
+	mFrameRateNextFrame	( 0 ),
+	mQueueKeepCounter	( 0 ),
+	mReusePaletteMeanDiff	( 0 ),
+	mReusePaletteMaxDiff	( 0 )
 {
+	AllocPendingFrames();
+	AllocPalettiseJobs();
 	Start();
 }
 
@@ -562,15 +1102,67 @@ Gif::TEncoder::TEncoder(std::shared_ptr<TMediaPacketBuffer>& OutputBuffer,size_t
 	SoyWorkerThread		( "Gif::TEncoder", SoyWorkerWaitMode::Wake ),
 	TMediaEncoder		( OutputBuffer ),
 	mStreamIndex		( StreamIndex ),
-	mCpuGifBlitter		( new TCpuGifBlitter() ),
+	mPixelsPool			( new TPixelsPool ),
+	mQualityGovernor	( Params.mAdaptiveQuality ? new TQualityGovernor( Params.mFrameRate, Params.mPalettiseThreadCount ) : nullptr ),
+	mCpuGifBlitter		( new TCpuGifBlitter(Params.mIndexLookupBits,mPixelsPool) ),
 	mParams				( Params ),
 	mPushedFrameCount	( 0 ),
-	mSkipFrames			( SkipFrames )
+	mExactPaletteFrameCount	( 0 ),
+	mReusedPaletteFrameCount	( 0 ),
+	mUnchangedFrameCount	( 0 ),
+	mFailedFrameCount	( 0 ),
+	mDecimatedFrameCount	( 0 ),
+	mDroppedNewestFrameCount	( 0 ),
+	mDroppedOldestFrameCount	( 0 ),
+	mThinnedFrameCount	( 0 ),
+	mBlockTimeoutFrameCount	( 0 ),
+	mChangedPixelCount	( 0 ),
+	mIndexMaskedPixelCount	( 0 ),
+	mMaskedFrameCount	( 0 ),
+	mKeyframeMasked		( false ),
+	mResyncPending		( false ),
+	mDroppingUntilResync	( false ),
+	mLastKeyframeIndex	( 0 ),
+	mSkipFrames			( SkipFrames ),
+	mFrameRateStarted	( false ),
+	mFrameRateNextFrame	( 0 ),
+	mQueueKeepCounter	( 0 ),
+	mReusePaletteMeanDiff	( 0 ),
+	mReusePaletteMaxDiff	( 0 )
 {
+	AllocPendingFrames();
+	AllocPalettiseJobs();
 	Start();
 }
 
 
+void Gif::TEncoder::AllocPendingFrames()
+{
+	//	skip mode only ever wants the latest frame
+	if ( mSkipFrames )
+	{
+		mParams.mQueuePolicy = TQueuePolicy::DropOldest;
+		mParams.mMaxPendingFrames = 1;
+	}
+	mParams.mMaxPendingFrames = std::max<size_t>( 1, mParams.mMaxPendingFrames );
+
+	//	room for frames that were already being copied when the queue filled. Drop-oldest makes room as it pushes
+	auto Capacity = mParams.mMaxPendingFrames * 2 + 2;
+	if ( mParams.mQueuePolicy == TQueuePolicy::DropOldest )
+		Capacity = mParams.mMaxPendingFrames;
+	mPendingFrames.reset( new TSpscRing<std::shared_ptr<TMediaPacket>>( Capacity ) );
+}
+
+
+void Gif::TEncoder::AllocPalettiseJobs()
+{
+	mPaletteTasks.reset( new TTaskPool( "Gif::TEncoder Palette", mParams.mPaletteSplitThreadCount ) );
+
+	auto MaxPendingJobs = mParams.mPalettiseThreadCount * 2;
+	mPalettiseJobs.reset( new TOrderedJobPool( "Gif::TEncoder Palettise", mParams.mPalettiseThreadCount, MaxPendingJobs ) );
+}
+
+
 Gif::TEncoder::~TEncoder()
 {
 	//	stop thread
@@ -578,13 +1170,21 @@ Gif::TEncoder::~TEncoder()
 	
 	//	if we're waiting on an opengl job, break it, as unity won't be running the opengl thread whilst destructing(running GC)
 	AbortJobSemaphores();
+
+	//	let go of any writers blocked waiting for space
+	mQueueSpaceChanged.notify_all();
 	
 	//	wait for thread to finish
 	WaitToFinish();
+
+	//	frames mid-indexing will fail with the aborted semaphores
+	mPalettiseJobs.reset();
 	
-	mPendingFramesLock.lock();
-	mPendingFrames.Clear();
-	mPendingFramesLock.unlock();
+	//	thread has stopped, so we're the consumer now
+	std::shared_ptr<TMediaPacket> PendingFrame;
+	while ( mPendingFrames->Pop( PendingFrame ) )
+	{
+	}
 
 	mOpenglGifBlitter.reset();
 //	mDirectxGifBlitter.reset();
@@ -622,6 +1222,13 @@ void Gif::TEncoder::Write(const Opengl::TTexture& Image,SoyTime Timecode,Opengl:
 	if ( mParams.mCpuOnly )
 		throw Soy::AssertException("GPU mode disabled");
 
+	//	pre-emptively skip frames
+	if ( !CanPushFrame(Timecode) )
+	{
+		OnFramePrePushSkipped(Timecode);
+		return;
+	}
+
 	//	all this needs to be done in the opengl thread
 	auto MakePacketFromTexture = [this,Image,Timecode]
 	{
@@ -680,6 +1287,12 @@ void Gif::TEncoder::Write(std::shared_ptr<SoyPixelsImpl> Image,SoyTime Timecode)
 {
 	Soy::Assert( Image != nullptr, "Gif::TEncoder::Write null pixels" );
 
+	if ( !IsFrameDue(Timecode) || !CanQueueFrame() )
+	{
+		OnFramePrePushSkipped(Timecode);
+		return;
+	}
+
 	std::shared_ptr<TMediaPacket> pPacket( new TMediaPacket );
 	auto& Packet = *pPacket;
 	Packet.mPixelBuffer = std::make_shared<TTextureBuffer>( Image );
@@ -689,9 +1302,14 @@ void Gif::TEncoder::Write(std::shared_ptr<SoyPixelsImpl> Image,SoyTime Timecode)
 	PushFrame( pPacket );
 }
 
+size_t Gif::TEncoder::GetPendingEncodeCount() const
+{
+	return mPendingFrames->GetSize() + mPalettiseJobs->GetPendingCount();
+}
+
 bool Gif::TEncoder::CanSleep()
 {
-	return mPendingFrames.GetSize() == 0;
+	return mPendingFrames->IsEmpty();
 }
 
 bool Gif::TEncoder::Iteration()
@@ -704,6 +1322,7 @@ bool Gif::TEncoder::Iteration()
 	//	extract pixels
 	//	gr: pool this copy and write palettised right back to packet data
 	std::shared_ptr<SoyPixelsImpl> Rgba;
+	bool OwnsRgba = true;	//	false if the pixels are the caller's, which we mustn't modify
 
 	try
 	{
@@ -720,15 +1339,16 @@ bool Gif::TEncoder::Iteration()
 				auto Semaphore = AllocJobSempahore();
 				//	copy for other thread in case the opengl job gets defferred for a long time and the buffer gets deleted in the meantime;
 				//	run -> stop(in editor) -> opengl queue paused, frames deleted -> enable -> job runs -> frame is deleted
-				auto Read = [&Rgba,Packet,Semaphore]
+				auto Read = [&Rgba,Packet,Semaphore,this]
 				{
 					static bool Flip = false;
 					//	gr: if semaphore has been aborted elsewhere (destructor) we know the Texture & Rgba are deleted!
 					if ( Semaphore->IsCompleted() )
 						return;
 
-					Rgba.reset( new SoyPixels );
 					auto& Texture = dynamic_cast<TTextureBuffer&>( *Packet.mPixelBuffer );
+					auto TextureMeta = Texture.mOpenglTexture->GetMeta();
+					Rgba = mPixelsPool->Alloc( SoyPixelsMeta( TextureMeta.GetWidth(), TextureMeta.GetHeight(), SoyPixelsFormat::RGBA ) );
 					Texture.mOpenglTexture->Read( *Rgba, SoyPixelsFormat::RGBA, Flip );
 				};
 				auto& Context = GetOpenglContext();
@@ -748,8 +1368,9 @@ bool Gif::TEncoder::Iteration()
 					if ( Semaphore->IsCompleted() )
 						return;
 
-					Rgba.reset( new SoyPixels );
 					auto& Texture = dynamic_cast<TTextureBuffer&>( *Packet.mPixelBuffer );
+					auto TextureMeta = Texture.mDirectxTexture->GetMeta();
+					Rgba = mPixelsPool->Alloc( SoyPixelsMeta( TextureMeta.GetWidth(), TextureMeta.GetHeight(), SoyPixelsFormat::RGBA ) );
 					Texture.mDirectxTexture->Read( *Rgba, *mDirectxGifBlitter->mContext );
 				};
 				auto& Context = GetDirectxContext();
@@ -760,6 +1381,7 @@ bool Gif::TEncoder::Iteration()
 			else if ( Texture.mPixels )
 			{
 				Rgba = Texture.mPixels;
+				OwnsRgba = false;
 			}
 			else
 			{
@@ -783,7 +1405,7 @@ bool Gif::TEncoder::Iteration()
 		return true;
 	}
 
-	SoyPixelsDef<Array<uint8>> PalettisedImage( Packet.mData, Packet.mMeta.mPixelMeta );
+	bool Resync = false;
 	try
 	{
 		const char* Shader = nullptr;
@@ -807,53 +1429,158 @@ bool Gif::TEncoder::Iteration()
 		}
 #endif
 
-		auto MaskPixel = [this](const vec3x<uint8>& Old,const vec3x<uint8>& New)
-		{
-			int Diff = abs( Old.x - New.x ) + abs( Old.y - New.y ) + abs( Old.z - New.z );
-			float Difff = Diff / (256.f*3.f);
-			if ( Difff > mParams.mMaskMaxDiff )
-				return false;
-			return true;
-		};
-		
 		Soy::Assert( Rgba!=nullptr, "Rgba shouldnt be null here");
-		if ( MakePalettisedImage( PalettisedImage, *Rgba, Packet.mIsKeyFrame, Shader, mParams, MaskPixel ) )
+
+		//	settings for this frame, which may have been lowered to keep up
+		auto FrameParams = mParams;
+		auto MaskStart = std::chrono::steady_clock::now();
+		if ( mQualityGovernor )
 		{
-			Packet.mMeta.mCodec = SoyMediaFormat::FromPixelFormat( Packet.mMeta.mPixelMeta.GetFormat() );
-		
-			//	drop packets
-			auto Block = []
-			{
-				return false;
-			};
-			
-			TMediaEncoder::PushFrame( pPacket, Block );
-			mPushedFrameCount++;
+			auto QueueDepth = mPendingFrames->GetSize() + mPalettiseJobs->GetPendingCount();
+			mQualityGovernor->OnFrameQueued( QueueDepth );
+			FrameParams = mQualityGovernor->GetParams( mParams );
 		}
-		else
+
+		auto SourceRgba = Rgba;
+		Rgba = DownscaleFrame( Rgba, FrameParams );
+		if ( Rgba != SourceRgba )
+			OwnsRgba = true;
+
+		//	differencing against the previous frame has to be done in order, here
+		TDirtyRect ImageRect;
+		std::shared_ptr<SoyPixelsImpl> ChangedRgba;
+		//	a frame that failed to palettise left later frames masked against pixels the decoder never got
+		Resync = mResyncPending.exchange( false );
+		bool ForceKeyframe = Resync || IsKeyframeDue( Packet.mTimecode );
+		if ( !MaskFrame( ChangedRgba, ImageRect, Rgba, OwnsRgba, Packet.mIsKeyFrame, ForceKeyframe, FrameParams ) )
 		{
-			//	all transparent, skipping packet. need to alter previous frame to extend time
-			//	gr: with a special packet?
+			//	all transparent, skipping packet. The muxer extends the previous frame's delay up to the next frame
+			mUnchangedFrameCount++;
+			return true;
 		}
-	}
-	catch(std::exception& e)
-	{
-		std::Debug << __func__ << " exception; " << e.what();
-	}
-	
-	return true;
-}
+
+		//	index masking can still make an unforced keyframe transparent in places, so those don't count towards the interval
+		bool KeepKeyframe = Packet.mIsKeyFrame && ( ForceKeyframe || !mKeyframeMasked || !FrameParams.mIndexMasking );
+		if ( KeepKeyframe )
+		{
+			mKeyframeMasked = true;
+			mLastKeyframeIndex = mMaskedFrameCount;
+			mLastKeyframeTimecode = Packet.mTimecode;
+		}
+
+		//	the governor counts queued frames itself, so time spent waiting for a palettise thread isn't included
+		auto MaskDuration = std::chrono::steady_clock::now() - MaskStart;
+
+		//	palette & indexing can run alongside other frames, output goes out in order
+		auto Palettise = [this,pPacket,ChangedRgba,ImageRect,Shader,FrameParams,MaskDuration]
+		{
+			auto PalettiseStart = std::chrono::steady_clock::now();
+			auto& Packet = *pPacket;
+			std::shared_ptr<TFrameBuffer> Frame( new TFrameBuffer( ImageRect ) );
+			MakePalettisedImage( *Frame, ChangedRgba, Packet.mIsKeyFrame, Shader, FrameParams );
+
+			//	downscale & mask on the encoder thread, plus this job's own run
+			if ( mQualityGovernor )
+			{
+				auto EncodeDuration = MaskDuration + ( std::chrono::steady_clock::now() - PalettiseStart );
+				auto EncodeMs = std::chrono::duration<float,std::milli>( EncodeDuration ).count();
+				mQualityGovernor->OnFrameEncoded( EncodeMs );
+			}
+
+			//	planes go to the muxer as they are, the meta is what they'd be packed as
+			auto Format = ( Frame->mPalette->GetFormat() == SoyPixelsFormat::RGBA ) ? SoyPixelsFormat::Palettised_RGBA_8 : SoyPixelsFormat::Palettised_RGB_8;
+			Packet.mMeta.mPixelMeta = SoyPixelsMeta( Frame->mIndexes->GetWidth(), Frame->mIndexes->GetHeight(), Format );
+			Packet.mMeta.mCodec = SoyMediaFormat::FromPixelFormat( Format );
+			Packet.mPixelBuffer = Frame;
+		};
+		
+		//	in output order, so any frame after this one that's already masked gets dropped too, until the forced keyframe
+		auto Failed = [this](const std::string& Error)
+		{
+			mFailedFrameCount++;
+			mDroppingUntilResync = true;
+			mResyncPending = true;
+		};
+
+		auto FrameWidth = Rgba->GetWidth();
+		auto FrameHeight = Rgba->GetHeight();
+		auto Output = [this,pPacket,ChangedRgba,FrameWidth,FrameHeight,KeepKeyframe,Resync,FrameParams,Failed]
+		{
+			//	failed to palettise
+			if ( !pPacket->mPixelBuffer )
+			{
+				Failed( "No palettised image" );
+				return;
+			}
+
+			if ( mDroppingUntilResync )
+			{
+				if ( !Resync )
+				{
+					mFailedFrameCount++;
+					return;
+				}
+				mDroppingUntilResync = false;
+			}
+
+			//	the canvas is only known in output order, so this can't go in the palettise job
+			auto& Frame = dynamic_cast<TFrameBuffer&>( *pPacket->mPixelBuffer );
+			if ( !MaskIndexes( Frame, *ChangedRgba, FrameWidth, FrameHeight, pPacket->mIsKeyFrame, KeepKeyframe, FrameParams ) )
+			{
+				mUnchangedFrameCount++;
+				return;
+			}
+			auto& PixelMeta = pPacket->mMeta.mPixelMeta;
+			PixelMeta = SoyPixelsMeta( Frame.mIndexes->GetWidth(), Frame.mIndexes->GetHeight(), PixelMeta.GetFormat() );
+
+			//	drop packets
+			auto Block = []
+			{
+				return false;
+			};
+			
+			auto Packet = pPacket;
+			TMediaEncoder::PushFrame( Packet, Block );
+			mPushedFrameCount++;
+		};
+
+		mPalettiseJobs->Push( Palettise, Output, Failed );
+	}
+	catch(std::exception& e)
+	{
+		std::Debug << __func__ << " exception; " << e.what();
+
+		//	still owed a keyframe
+		if ( Resync )
+			mResyncPending = true;
+	}
+	
+	return true;
+}
 
 
 void Gif::TEncoder::PushFrame(std::shared_ptr<TMediaPacket> Frame)
 {
-	std::lock_guard<std::mutex> Lock( mPendingFramesLock );
+	bool Pushed;
+	std::shared_ptr<TMediaPacket> Oldest;	//	released outside the lock
+	{
+		std::lock_guard<std::mutex> Lock( mPendingFramesLock );
 
-	//	make this the latest frame in the queue
-	if ( mSkipFrames )
-		mPendingFrames.Clear();
+		//	the latest frame always goes in, making room by losing the oldest waiting
+		if ( mParams.mQueuePolicy == TQueuePolicy::DropOldest && mPendingFrames->GetSize() >= mParams.mMaxPendingFrames )
+		{
+			if ( mPendingFrames->Pop( Oldest ) )
+				mDroppedOldestFrameCount++;
+		}
+		Pushed = mPendingFrames->Push( Frame );
+	}
 
-	mPendingFrames.PushBack( Frame );
+	//	frames already being copied when the queue filled up can overflow it
+	if ( !Pushed )
+	{
+		mDroppedNewestFrameCount++;
+		return;
+	}
 	
 	Wake();
 }
@@ -861,11 +1588,33 @@ void Gif::TEncoder::PushFrame(std::shared_ptr<TMediaPacket> Frame)
 
 std::shared_ptr<TMediaPacket> Gif::TEncoder::PopFrame()
 {
-	if ( mPendingFrames.IsEmpty() )
+	std::shared_ptr<TMediaPacket> Frame;
+
+	//	drop-oldest writers pop from this end too, under the lock they push with
+	bool Popped;
+	if ( mParams.mQueuePolicy == TQueuePolicy::DropOldest )
+	{
+		std::lock_guard<std::mutex> Lock( mPendingFramesLock );
+		Popped = mPendingFrames->Pop( Frame );
+	}
+	else
+	{
+		Popped = mPendingFrames->Pop( Frame );
+	}
+
+	if ( !Popped )
 		return nullptr;
-	
-	std::lock_guard<std::mutex> Lock( mPendingFramesLock );
-	return mPendingFrames.PopAt(0);
+
+	if ( mParams.mQueuePolicy == TQueuePolicy::Block )
+	{
+		//	lock so a writer can't miss this between checking for space and waiting
+		{
+			std::lock_guard<std::mutex> Lock( mQueueSpaceLock );
+		}
+		mQueueSpaceChanged.notify_all();
+	}
+
+	return Frame;
 }
 
 Opengl::TContext& Gif::TEncoder::GetOpenglContext()
@@ -892,18 +1641,51 @@ Directx::TContext& Gif::TEncoder::GetDirectxContext()
 
 void Gif::TEncoder::GetMeta(TJsonWriter& Json)
 {
-	auto PendingFrameCount = mPendingFrames.GetSize();
+	auto PendingFrameCount = mPendingFrames->GetSize();
 
-	Json.Push("PushedFrameCount", mPushedFrameCount);
+	Json.Push("PushedFrameCount", mPushedFrameCount.load() );
 	Json.Push("PendingFrameCount", PendingFrameCount);
+	Json.Push("PalettisingFrameCount", mPalettiseJobs->GetPendingCount() );
+	Json.Push("ExactPaletteFrameCount", mExactPaletteFrameCount.load() );
+	Json.Push("ReusedPaletteFrameCount", mReusedPaletteFrameCount.load() );
+	Json.Push("UnchangedFrameCount", mUnchangedFrameCount.load() );
+	Json.Push("FailedFrameCount", mFailedFrameCount.load() );
+	Json.Push("DecimatedFrameCount", mDecimatedFrameCount.load() );
+	Json.Push("QueuePolicy", std::string( TQueuePolicy::ToString( mParams.mQueuePolicy ) ) );
+	Json.Push("DroppedNewestFrameCount", mDroppedNewestFrameCount.load() );
+	Json.Push("DroppedOldestFrameCount", mDroppedOldestFrameCount.load() );
+	Json.Push("ThinnedFrameCount", mThinnedFrameCount.load() );
+	Json.Push("BlockTimeoutFrameCount", mBlockTimeoutFrameCount.load() );
+	Json.Push("ChangedPixelCount", mChangedPixelCount.load() );
+	Json.Push("IndexMaskedPixelCount", mIndexMaskedPixelCount.load() );
+	Json.Push("PixelsPoolSize", mPixelsPool->GetFreeCount() );
+	Json.Push("PixelsPoolHitPercent", mPixelsPool->GetHitPercent() );
+
+	if ( mQualityGovernor )
+	{
+		Json.Push("QualityLevel", mQualityGovernor->GetLevel() );
+		Json.Push("EncodeMs", mQualityGovernor->GetAverageEncodeMs() );
+	}
+
+	if ( mCpuGifBlitter )
+	{
+		std::string SimdLevel = Gif::TSimdLevel::ToString( Gif::GetSimdLevel() );
+		Json.Push("CpuSimd", SimdLevel );
+
+		auto& LookupCache = *mCpuGifBlitter->mLookupCache;
+		if ( LookupCache.IsEnabled() )
+		{
+			Json.Push("IndexLookupHits", LookupCache.mHitCount.load() );
+			Json.Push("IndexLookupBuilds", LookupCache.mBuildCount.load() );
+		}
+	}
 }
 
 
 void GifExtractPalette(const SoyPixelsImpl& Frame,SoyPixelsImpl& Palette,size_t PixelSkip)
 {
-	Soy::Assert( Frame.GetFormat() == SoyPixelsFormat::RGBA, "GifExtractPalette currently requires RGBA" );
-
 	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs  );
+	Gif::TPixelLayout Layout( Frame.GetFormat() );
 	auto PixelStep = 1 + PixelSkip;
 	auto PaletteSize = Frame.GetWidth() * Frame.GetHeight();
 	//	dx requires RGBA, not RGB
@@ -919,16 +1701,17 @@ void GifExtractPalette(const SoyPixelsImpl& Frame,SoyPixelsImpl& Palette,size_t
 	else
 	{
 		int PaletteIndex = 0;
+		auto* FramePixels = Frame.GetPixelsArray().GetArray();
 
 		for ( int i=0;	i<Palette.GetWidth();	i++ )
 		{
-			auto xy = Frame.GetXy( i*PixelStep );
-			auto rgba = Frame.GetPixel4( xy.x, xy.y );
+			auto* Pixel = &FramePixels[ i * PixelStep * Layout.mChannels ];
 			//	skip alphas
-			if ( rgba.w == 0 )
+			if ( Layout.mHasAlpha && Pixel[3] == 0 )
 				continue;
 
-			Palette.SetPixel( PaletteIndex, 0, rgba.xyz() );
+			vec3x<uint8> Colour( Pixel[Layout.mRed], Pixel[Layout.mGreen], Pixel[Layout.mBlue] );
+			Palette.SetPixel( PaletteIndex, 0, Colour );
 			PaletteIndex++;
 		}
 		
@@ -949,39 +1732,227 @@ void Gif::GetPalette(SoyPixelsImpl& Palette,const SoyPixelsImpl& Rgba,const TEnc
 		return;
 	}
 
+	if ( Params.mPaletteHistogramBits != 0 )
+	{
+		GetHistogramPalette( Palette, Rgba, Params );
+		return;
+	}
+
 	GifExtractPalette( Rgba, Palette, Params.mFindPalettePixelSkip );
 }
 
-void Gif::ShrinkPalette(SoyPixelsImpl& Palette,bool Sort,const TEncodeParams& Params)
+
+void Gif::GetHistogramPalette(SoyPixelsImpl& Palette,const SoyPixelsImpl& Rgba,const TEncodeParams& Params)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+
+	//	index 0 gets overwritten by the transparent colour, and forced colours go after the quantised ones, so don't waste colours on them
+	auto ForcedCount = Params.mForcedPaletteColours.GetSize();
+	auto MaxColours = std::min<size_t>( Params.mMaxColours, 256 );
+	Soy::Assert( MaxColours > 1 + ForcedCount, "Not enough palette colours for transparent & forced colours" );
+
+	BufferArray<Soy::TRgb8,256> Colours;
+	auto Bits = std::min<size_t>( std::max<size_t>( Params.mPaletteHistogramBits, 4 ), 6 );
+	GifMakeHistogramPalette( Rgba, Params.mFindPalettePixelSkip, Bits, MaxColours - 1 - ForcedCount, GetArrayBridge(Colours) );
+
+	//	all transparent
+	if ( Colours.IsEmpty() )
+	{
+		Palette.Init( 0, 1, SoyPixelsFormat::RGBA );
+		return;
+	}
+
+	//	sized to what's used, rather than padded out for ShrinkPalette to write forced colours at the end
+	auto PaletteSize = 1 + Colours.GetSize() + ForcedCount;
+
+	//	dx requires RGBA, not RGB
+	Palette.Init( PaletteSize, 1, SoyPixelsFormat::RGBA );
+	Palette.SetPixel( 0, 0, Params.mTransparentColour );
+	for ( size_t i=0;	i<Colours.GetSize();	i++ )
+		Palette.SetPixel( 1 + i, 0, Colours[i] );
+	for ( size_t i=0;	i<ForcedCount;	i++ )
+		Palette.SetPixel( 1 + Colours.GetSize() + i, 0, Params.mForcedPaletteColours[i] );
+}
+
+//	UI, pixel art, flat shading etc often have fewer unique colours than the palette holds, so don't need
+//	quantising at all. Colours are collected in a small open-addressed set, indexing as we go, and we bail
+//	out as soon as there are too many.
+bool Gif::GetExactPalette(SoyPixelsImpl& Palette,SoyPixelsImpl& IndexedImage,const SoyPixelsImpl& Rgba,const TEncodeParams& Params)
 {
 	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
 
+	static const uint8 TransparentIndex = 0;
+	//	2x the most colours we can hold keeps probes short
+	static const size_t SlotBits = 9;
+	static const size_t SlotCount = 1 << SlotBits;
+	static const uint32 EmptySlot = 0;
+	static const uint32 UsedBit = 1 << 24;
+
+	if ( !TPixelLayout::IsSupported( Rgba.GetFormat() ) )
+		return false;
+	TPixelLayout Layout( Rgba.GetFormat() );
+	auto Channels = Layout.mChannels;
+	bool HasAlpha = Layout.mHasAlpha;
+
+	//	index 0 is transparent
+	auto MaxColours = std::min<size_t>( Params.mMaxColours, 256 );
+	if ( MaxColours < 2 )
+		return false;
+	auto MaxOpaqueColours = MaxColours - 1;
+
+	uint32 SlotKeys[SlotCount];
+	uint8 SlotIndexes[SlotCount];
+	std::fill( SlotKeys, SlotKeys+SlotCount, EmptySlot );
+	uint32 Colours[256];
+	size_t ColourCount = 0;
+
+	auto Width = Rgba.GetWidth();
+	auto Height = Rgba.GetHeight();
+	IndexedImage.Init( Width, Height, SoyPixelsFormat::Greyscale );
+	auto* SourcePixels = Rgba.GetPixelsArray().GetArray();
+	auto* IndexPixels = IndexedImage.GetPixelsArray().GetArray();
+
+	//	runs of the same colour skip the lookup
+	uint32 LastKey = EmptySlot;
+	uint8 LastIndex = TransparentIndex;
+
+	auto PixelCount = Width * Height;
+	for ( size_t i=0;	i<PixelCount;	i++ )
+	{
+		auto* Pixel = &SourcePixels[ i * Channels ];
+		if ( HasAlpha && Pixel[3] == 0 )
+		{
+			IndexPixels[i] = TransparentIndex;
+			continue;
+		}
+
+		uint32 Key = UsedBit | (Pixel[Layout.mRed] << 16) | (Pixel[Layout.mGreen] << 8) | Pixel[Layout.mBlue];
+		if ( Key != LastKey )
+		{
+			auto Slot = ( Key * 2654435761u ) >> (32-SlotBits);
+			while ( SlotKeys[Slot] != EmptySlot && SlotKeys[Slot] != Key )
+				Slot = (Slot+1) & (SlotCount-1);
+
+			if ( SlotKeys[Slot] == EmptySlot )
+			{
+				if ( ColourCount >= MaxOpaqueColours )
+					return false;
+				SlotKeys[Slot] = Key;
+				SlotIndexes[Slot] = size_cast<uint8>( 1 + ColourCount );
+				Colours[ColourCount] = Key;
+				ColourCount++;
+			}
+			LastKey = Key;
+			LastIndex = SlotIndexes[Slot];
+		}
+		IndexPixels[i] = LastIndex;
+	}
+
+	//	nothing opaque, leave it to the normal path
+	if ( ColourCount == 0 )
+		return false;
+
+	//	dx requires RGBA, not RGB
+	Palette.Init( 1 + ColourCount, 1, SoyPixelsFormat::RGBA );
+	Palette.SetPixel( TransparentIndex, 0, Params.mTransparentColour );
+	for ( size_t i=0;	i<ColourCount;	i++ )
+	{
+		auto Key = Colours[i];
+		vec3x<uint8> Colour( (Key >> 16) & 0xff, (Key >> 8) & 0xff, Key & 0xff );
+		Palette.SetPixel( 1 + i, 0, Colour );
+	}
+	return true;
+}
+
+
+void Gif::ShrinkPalette(SoyPixelsImpl& Palette,bool Sort,const TEncodeParams& Params,TTaskPool& Tasks)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+
+	//	forced colours go at the end of the palette, starting one in
 	//	gr: starting one less, was't catching last colour on directx... odd sampling of palette? can't quite figure it out atm
-	static int StartIndex = 254;
+	auto ForcedCount = Params.mForcedPaletteColours.GetSize();
 
-	//	already shrunk
-	if ( Palette.GetWidth() <= Params.mMaxColours && !Sort )
+	//	already shrunk (and there's room for the forced colours, otherwise the tree below pads it out)
+	if ( Palette.GetWidth() <= Params.mMaxColours && Palette.GetWidth() >= 2 + ForcedCount && !Sort )
 	{
-		//	overwrite the forced colours
+		//	overwrite the forced colours. A lowered colour count can leave this smaller than 256
 		//	gr: change palettiser to only get 256-forced
-		for ( int i=0;	i<Params.mForcedPaletteColours.GetSize();	i++ )
-			Palette.SetPixel( StartIndex - i, 0, Params.mForcedPaletteColours[i] );
+		auto ForcedStartIndex = std::min<size_t>( Palette.GetWidth(), 256 ) - 2;
+		for ( size_t i=0;	i<ForcedCount;	i++ )
+			Palette.SetPixel( ForcedStartIndex - i, 0, Params.mForcedPaletteColours[i] );
 		return;
 	}
 
+	//	the k-d tree only comes in powers of 2, and clipping a bigger one would drop whole branches (a corner of the
+	//	colour space) so quantise to the biggest that fits. 255 (the default) still builds 256 and loses the last leaf
+	auto MaxColours = std::min<size_t>( Params.mMaxColours, 255 );
+	size_t PaletteSize = 256;
+	while ( PaletteSize > MaxColours + 1 )
+		PaletteSize /= 2;
+	Soy::Assert( PaletteSize >= 2 + ForcedCount, "Not enough palette colours for transparent & forced colours" );
+
 	std::shared_ptr<GifPalette> SmallPalette;
-	GifMakePalette( Palette, false, SmallPalette, 256 );
+	GifMakePalette( Palette, false, SmallPalette, PaletteSize, &Tasks );
 
 	//	overwrite the forced colours
 	//	gr: change palettiser to only get 256-forced
-	for ( int i=0;	i<Params.mForcedPaletteColours.GetSize();	i++ )
-		SmallPalette->SetColour( StartIndex - i, Params.mForcedPaletteColours[i] );
+	auto ForcedStartIndex = PaletteSize - 2;
+	for ( size_t i=0;	i<ForcedCount;	i++ )
+		SmallPalette->SetColour( ForcedStartIndex - i, Params.mForcedPaletteColours[i] );
 
 	Palette.Copy( SmallPalette->GetPalette() );
 
 	//	shrink to required size
-	if ( Palette.GetWidth() > Params.mMaxColours )
-		Palette.ResizeClip( Params.mMaxColours, 1 );
+	if ( Palette.GetWidth() > MaxColours )
+		Palette.ResizeClip( MaxColours, 1 );
+}
+
+
+//	lzw codes only depend on the run structure, which reordering doesn't change, but the most used colours get the
+//	lowest indexes, so frames sharing this palette tend to stay under a smaller code size. Entries up to the
+//	transparent index stay where they are
+void Gif::SortPaletteByUse(SoyPixelsImpl& Palette,SoyPixelsImpl& IndexedImage,size_t TransparentIndex)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+	auto PaletteSize = Palette.GetWidth();
+	Soy::Assert( PaletteSize <= 256, "Palette too big to sort" );
+
+	size_t Counts[256] = {0};
+	auto& Indexes = IndexedImage.GetPixelsArray();
+	auto* IndexPixels = Indexes.GetArray();
+	auto PixelCount = Indexes.GetSize();
+	for ( size_t i=0;	i<PixelCount;	i++ )
+		Counts[IndexPixels[i]]++;
+
+	BufferArray<uint8,256> Order;
+	for ( size_t i=0;	i<PaletteSize;	i++ )
+		Order.PushBack( size_cast<uint8>( i ) );
+	auto FirstSorted = std::min( TransparentIndex+1, PaletteSize );
+	std::stable_sort( Order.GetArray()+FirstSorted, Order.GetArray()+PaletteSize, [&Counts](uint8 a,uint8 b)
+	{
+		return Counts[a] > Counts[b];
+	});
+
+	uint8 Remap[256];
+	bool Changed = false;
+	for ( size_t i=0;	i<PaletteSize;	i++ )
+	{
+		Remap[Order[i]] = size_cast<uint8>( i );
+		Changed |= ( Order[i] != i );
+	}
+	if ( !Changed )
+		return;
+
+	auto Channels = Palette.GetChannels();
+	uint8 Colours[256*4];
+	auto* PalettePixels = Palette.GetPixelsArray().GetArray();
+	memcpy( Colours, PalettePixels, PaletteSize * Channels );
+	for ( size_t i=0;	i<PaletteSize;	i++ )
+		memcpy( &PalettePixels[i*Channels], &Colours[Order[i]*Channels], Channels );
+
+	for ( size_t i=0;	i<PixelCount;	i++ )
+		IndexPixels[i] = Remap[IndexPixels[i]];
 }
 
 
@@ -1010,8 +1981,15 @@ std::shared_ptr<SoyPixelsImpl> Gif::TEncoder::IndexImageWithShader(std::shared_p
 	}
 }
 
-void Gif::MaskImage(SoyPixelsImpl& RgbaMutable,const SoyPixelsImpl& PrevRgb,bool& Keyframe,bool TestAlpha,const TEncodeParams& Params,TMaskPixelFunc MaskPixelFunc)
+void Gif::MaskImage(SoyPixelsImpl& RgbaMutable,const SoyPixelsImpl& PrevRgb,bool& Keyframe,TDirtyRect& ChangedRect,size_t& ChangedPixelCount,bool TestAlpha,const TEncodeParams& Params)
 {
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+
+	auto Width = RgbaMutable.GetWidth();
+	auto Height = RgbaMutable.GetHeight();
+	ChangedRect = TDirtyRect( 0, 0, Width, Height );
+	ChangedPixelCount = Width * Height;
+
 	if ( TestAlpha )
 	{
 		//	mask image
@@ -1028,62 +2006,509 @@ void Gif::MaskImage(SoyPixelsImpl& RgbaMutable,const SoyPixelsImpl& PrevRgb,bool
 		Keyframe = false;
 	}
 	
-	//	mask image
-	if ( MaskPixelFunc )
+	//	resolution changed, everything has changed
+	if ( PrevRgb.GetWidth() != Width || PrevRgb.GetHeight() != Height || PrevRgb.GetFormat() != RgbaMutable.GetFormat() || RgbaMutable.GetChannels() != 4 )
+	{
+		ChangedPixelCount = Width * Height;
+		return;
+	}
+
+	//	diff is sum of abs rgb differences, out of 256*3
+	auto MaxDiff = static_cast<int>( std::floor( std::min( Params.mMaskMaxDiff, 1.f ) * 256.f * 3.f ) );
+	auto MaskRow = GetMaskRowFunc( GetSimdLevel(), MaxDiff == 0 );
+
+	//	bounds of the pixels left opaque
+	size_t MinX = Width;
+	size_t MinY = Height;
+	size_t MaxX = 0;
+	size_t MaxY = 0;
+	ChangedPixelCount = 0;
+
+	auto Stride = Width * 4;
+	auto* PrevPixels = PrevRgb.GetPixelsArray().GetArray();
+	auto* NewPixels = RgbaMutable.GetPixelsArray().GetArray();
+	for ( size_t y=0;	y<Height;	y++ )
 	{
-		for ( int y=0;	y<RgbaMutable.GetHeight();	y++ )
+		TMaskRowResult Row;
+		MaskRow( &PrevPixels[y*Stride], &NewPixels[y*Stride], Width, MaxDiff, Row );
+
+		//	match, so alpha'd away
+		if ( Row.mMasked )
+			Keyframe = false;
+
+		if ( Row.mChangedCount == 0 )
+			continue;
+		ChangedPixelCount += Row.mChangedCount;
+		MinX = std::min( MinX, Row.mMinX );
+		MaxX = std::max( MaxX, Row.mMaxX );
+		MinY = std::min( MinY, y );
+		MaxY = y;
+	}
+
+	if ( ChangedPixelCount == 0 )
+		ChangedRect = TDirtyRect();
+	else
+		ChangedRect = TDirtyRect( MinX, MinY, MaxX-MinX+1, MaxY-MinY+1 );
+}
+
+
+void Gif::CropImage(SoyPixelsImpl& Cropped,const SoyPixelsImpl& Source,const TDirtyRect& Rect)
+{
+	Soy::Assert( Rect.mLeft + Rect.mWidth <= Source.GetWidth() && Rect.mTop + Rect.mHeight <= Source.GetHeight(), "Crop rect out of bounds" );
+	Cropped.Init( Rect.mWidth, Rect.mHeight, Source.GetFormat() );
+
+	auto Channels = Source.GetChannels();
+	auto SourceStride = Source.GetWidth() * Channels;
+	auto CroppedStride = Rect.mWidth * Channels;
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	auto* CroppedPixels = Cropped.GetPixelsArray().GetArray();
+	for ( size_t y=0;	y<Rect.mHeight;	y++ )
+	{
+		auto* SourceRow = &SourcePixels[ (Rect.mTop + y) * SourceStride + Rect.mLeft * Channels ];
+		memcpy( &CroppedPixels[ y * CroppedStride ], SourceRow, CroppedStride );
+	}
+}
+
+//	3 to 4 channels, keeping the channel order, in the one pass
+void Gif::CopyWithAlpha(SoyPixelsImpl& Rgba,const SoyPixelsImpl& Rgb)
+{
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+	Soy::Assert( Rgb.GetChannels() == 3 && Rgba.GetChannels() == 4, "CopyWithAlpha expects 3 channels to 4" );
+	Soy::Assert( Rgb.GetWidth() == Rgba.GetWidth() && Rgb.GetHeight() == Rgba.GetHeight(), "CopyWithAlpha size mismatch" );
+
+	auto PixelCount = Rgb.GetWidth() * Rgb.GetHeight();
+	auto* RgbPixels = Rgb.GetPixelsArray().GetArray();
+	auto* RgbaPixels = Rgba.GetPixelsArray().GetArray();
+	for ( size_t i=0;	i<PixelCount;	i++ )
+	{
+		RgbaPixels[i*4+0] = RgbPixels[i*3+0];
+		RgbaPixels[i*4+1] = RgbPixels[i*3+1];
+		RgbaPixels[i*4+2] = RgbPixels[i*3+2];
+		RgbaPixels[i*4+3] = 255;
+	}
+}
+
+
+//	false if the frame stays as it is
+bool Gif::GetDownscaleSize(size_t& Width,size_t& Height,const TEncodeParams& Params)
+{
+	auto SourceWidth = Width;
+	auto SourceHeight = Height;
+	float Scale = std::min( Params.mScale, 1.f );
+	if ( Params.mMaxWidth > 0 )
+		Scale = std::min( Scale, Params.mMaxWidth / static_cast<float>(SourceWidth) );
+	if ( Params.mMaxHeight > 0 )
+		Scale = std::min( Scale, Params.mMaxHeight / static_cast<float>(SourceHeight) );
+	if ( Scale <= 0.f )
+		return false;
+
+	Width = std::max<size_t>( 1, static_cast<size_t>( SourceWidth * Scale + 0.5f ) );
+	Height = std::max<size_t>( 1, static_cast<size_t>( SourceHeight * Scale + 0.5f ) );
+	Width = std::min( Width, SourceWidth );
+	Height = std::min( Height, SourceHeight );
+	return Width != SourceWidth || Height != SourceHeight;
+}
+
+
+//	2x2 box filter. An odd last row or column is dropped
+void Gif::HalveImage(SoyPixelsImpl& Halved,const SoyPixelsImpl& Source)
+{
+	TPixelLayout Layout( Source.GetFormat() );
+	auto Channels = Layout.mChannels;
+	auto Width = Source.GetWidth() / 2;
+	auto Height = Source.GetHeight() / 2;
+	Halved.Init( Width, Height, Source.GetFormat() );
+
+	//	the kernels work on 4 byte pixels, and don't care about the order
+	auto HalveRow = GetHalveRowFunc( GetSimdLevel() );
+	auto Average = [](int a,int b)
+	{
+		return ( a + b + 1 ) >> 1;
+	};
+
+	auto SourceStride = Source.GetWidth() * Channels;
+	auto HalvedStride = Width * Channels;
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	auto* HalvedPixels = Halved.GetPixelsArray().GetArray();
+	for ( size_t y=0;	y<Height;	y++ )
+	{
+		auto* Row0 = &SourcePixels[ (y*2+0) * SourceStride ];
+		auto* Row1 = &SourcePixels[ (y*2+1) * SourceStride ];
+		auto* Out = &HalvedPixels[ y * HalvedStride ];
+		if ( Channels == 4 )
+		{
+			HalveRow( Row0, Row1, Out, Width );
+			continue;
+		}
+
+		//	same rounding as the kernels
+		for ( size_t i=0;	i<HalvedStride;	i++ )
 		{
-			for ( int x=0;	x<RgbaMutable.GetWidth();	x++ )
+			auto x = (i / Channels) * Channels * 2 + (i % Channels);
+			auto Left = Average( Row0[x], Row1[x] );
+			auto Right = Average( Row0[x+Channels], Row1[x+Channels] );
+			Out[i] = static_cast<uint8>( Average( Left, Right ) );
+		}
+	}
+}
+
+
+//	bilinear, to whatever size Resized is already. Only used for the last step of less than half, so skipping pixels isn't a concern
+void Gif::ResizeImage(SoyPixelsImpl& Resized,const SoyPixelsImpl& Source)
+{
+	Soy::Assert( Source.GetFormat() == Resized.GetFormat(), "Resizing can't change format" );
+	auto Channels = TPixelLayout( Source.GetFormat() ).mChannels;
+	auto SourceWidth = Source.GetWidth();
+	auto SourceHeight = Source.GetHeight();
+	auto Width = Resized.GetWidth();
+	auto Height = Resized.GetHeight();
+
+	//	8 bit fixed point weights. Sample centres line up with source centres
+	auto GetSample = [](size_t Index,size_t Size,size_t SourceSize,size_t& First,size_t& Second,int& Weight)
+	{
+		float Position = ( Index + 0.5f ) * SourceSize / static_cast<float>(Size) - 0.5f;
+		Position = std::max( 0.f, Position );
+		First = std::min( static_cast<size_t>( Position ), SourceSize-1 );
+		Second = std::min( First+1, SourceSize-1 );
+		Weight = static_cast<int>( ( Position - First ) * 256.f + 0.5f );
+	};
+
+	Array<size_t> Columns;
+	Array<int> ColumnWeights;
+	Columns.SetSize( Width*2 );
+	ColumnWeights.SetSize( Width );
+	for ( size_t x=0;	x<Width;	x++ )
+		GetSample( x, Width, SourceWidth, Columns[x*2+0], Columns[x*2+1], ColumnWeights[x] );
+
+	auto SourceStride = SourceWidth * Channels;
+	auto* SourcePixels = Source.GetPixelsArray().GetArray();
+	auto* ResizedPixels = Resized.GetPixelsArray().GetArray();
+	for ( size_t y=0;	y<Height;	y++ )
+	{
+		size_t y0,y1;
+		int yWeight;
+		GetSample( y, Height, SourceHeight, y0, y1, yWeight );
+		auto* Row0 = &SourcePixels[ y0 * SourceStride ];
+		auto* Row1 = &SourcePixels[ y1 * SourceStride ];
+		auto* Out = &ResizedPixels[ y * Width * Channels ];
+
+		for ( size_t x=0;	x<Width;	x++ )
+		{
+			auto x0 = Columns[x*2+0] * Channels;
+			auto x1 = Columns[x*2+1] * Channels;
+			auto xWeight = ColumnWeights[x];
+			for ( size_t c=0;	c<Channels;	c++ )
 			{
-				auto* pOldRgba = &PrevRgb.GetPixelPtr( x, y, 0 );
-				auto* pNewRgba = &RgbaMutable.GetPixelPtr( x, y, 0 );
-				auto& OldRgba = *reinterpret_cast<const vec3x<uint8>*>(pOldRgba);
-				auto& NewRgba = *reinterpret_cast<vec3x<uint8>*>(pNewRgba);
-				if ( !MaskPixelFunc( OldRgba, NewRgba ) )
-					continue;
-				
-				//	match, so alpha away
-				pNewRgba[3] = 0;
-				Keyframe = false;
+				int Top = Row0[x0+c] * (256-xWeight) + Row0[x1+c] * xWeight;
+				int Bottom = Row1[x0+c] * (256-xWeight) + Row1[x1+c] * xWeight;
+				int Value = Top * (256-yWeight) + Bottom * yWeight;
+				Out[x*Channels+c] = static_cast<uint8>( ( Value + (1<<15) ) >> 16 );
 			}
 		}
 	}
 }
 
-bool Gif::TEncoder::MakePalettisedImage(SoyPixelsImpl& PalettisedImage,const SoyPixelsImpl& OriginalRgba,bool& Keyframe,const char* IndexingShader,const TEncodeParams& Params,TMaskPixelFunc MaskPixelFunc)
+
+//	box filter halves while the target is still half the size or less, then bilinear for whatever's left.
+//	everything after this (masking, palette, indexing, lzw) costs per pixel, so this is where shrinking pays
+std::shared_ptr<SoyPixelsImpl> Gif::TEncoder::DownscaleFrame(std::shared_ptr<SoyPixelsImpl> Rgba,const TEncodeParams& Params)
 {
-	std::shared_ptr<SoyPixelsImpl> pNewPalette;
+	auto Width = Rgba->GetWidth();
+	auto Height = Rgba->GetHeight();
+	if ( !GetDownscaleSize( Width, Height, Params ) )
+		return Rgba;
+
+	Soy::TScopeTimerPrint Timer(__func__, Gif::TimerMinMs );
+	auto Downscaled = Rgba;
+	while ( Downscaled->GetWidth() >= Width*2 && Downscaled->GetHeight() >= Height*2 )
+	{
+		auto Halved = mPixelsPool->Alloc( SoyPixelsMeta( Downscaled->GetWidth()/2, Downscaled->GetHeight()/2, Downscaled->GetFormat() ) );
+		HalveImage( *Halved, *Downscaled );
+		Downscaled = Halved;
+	}
 
-	int TransparentIndex = 0;
-	int DebugTransparentIndex = 1;
+	if ( Downscaled->GetWidth() != Width || Downscaled->GetHeight() != Height )
+	{
+		auto Resized = mPixelsPool->Alloc( SoyPixelsMeta( Width, Height, Downscaled->GetFormat() ) );
+		ResizeImage( *Resized, *Downscaled );
+		Downscaled = Resized;
+	}
+
+	return Downscaled;
+}
+
+
+bool Gif::TEncoder::IsKeyframeDue(SoyTime Timecode)
+{
+	//	until there's been one, frames aren't masked anyway
+	if ( !mKeyframeMasked )
+		return false;
+
+	auto FrameInterval = mParams.mKeyframeIntervalFrames;
+	if ( FrameInterval > 0 && mMaskedFrameCount - mLastKeyframeIndex >= FrameInterval )
+		return true;
+
+	auto TimeInterval = static_cast<int64_t>( mParams.mKeyframeIntervalMs );
+	if ( TimeInterval > 0 && Timecode.GetDiff( mLastKeyframeTimecode ) >= TimeInterval )
+		return true;
+
+	return false;
+}
+
+
+bool Gif::TEncoder::MaskFrame(std::shared_ptr<SoyPixelsImpl>& ChangedRgba,TDirtyRect& ImageRect,std::shared_ptr<SoyPixelsImpl>& OriginalRgba,bool OwnsRgba,bool& Keyframe,bool ForceKeyframe,const TEncodeParams& Params)
+{
 	static bool TestAlphaSquare = false;
 	Keyframe = true;
 
 	//	if frame count is too low, and 3 identical frames, we won't push the first X frames
 	//	and from editor seems like it does nothing
 	static int MinFramePushForIntra = 3;
-	bool AllowIntraFrames = (mPushedFrameCount>MinFramePushForIntra) && Params.mAllowIntraFrames;
-	bool DoMasking = TestAlphaSquare || AllowIntraFrames;
+	bool AllowIntraFrames = (mMaskedFrameCount>MinFramePushForIntra) && Params.mAllowIntraFrames;
+	bool DoMasking = ( TestAlphaSquare || AllowIntraFrames ) && !ForceKeyframe;
 	
-	std::shared_ptr<SoyPixelsImpl> Rgba( new SoyPixels( OriginalRgba ) );
+	//	masking alphas the frame in place, then it's kept as the previous frame. Readbacks are ours, but
+	//	cpu input is the caller's, so copy that.
+	//	RGB & BGR frames that may be masked (now or as the previous frame) get an alpha channel as they're copied
+	std::shared_ptr<SoyPixelsImpl> Rgba = OriginalRgba;
+	TPixelLayout Layout( OriginalRgba->GetFormat() );
+	bool NeedsAlpha = !Layout.mHasAlpha && ( TestAlphaSquare || Params.mAllowIntraFrames );
+	if ( NeedsAlpha )
+	{
+		auto AlphaFormat = ( Layout.mRed == 0 ) ? SoyPixelsFormat::RGBA : SoyPixelsFormat::BGRA;
+		Rgba = mPixelsPool->Alloc( SoyPixelsMeta( OriginalRgba->GetWidth(), OriginalRgba->GetHeight(), AlphaFormat ) );
+		CopyWithAlpha( *Rgba, *OriginalRgba );
+	}
+	else if ( !OwnsRgba )
+	{
+		Rgba = mPixelsPool->Alloc( OriginalRgba->GetMeta() );
+		Rgba->GetPixelsArray().Copy( OriginalRgba->GetPixelsArray() );
+	}
+	ImageRect = TDirtyRect( 0, 0, Rgba->GetWidth(), Rgba->GetHeight() );
 
 	if ( DoMasking && mPrevRgb )
 	{
-		Soy::Assert( Rgba->GetFormat() == SoyPixelsFormat::RGBA, "Need input to have an alpha channel. SHould be set form opengl read" );
-		auto& RgbaMutable = const_cast<SoyPixelsImpl&>( *Rgba );
-		MaskImage( RgbaMutable, *mPrevRgb, Keyframe, TestAlphaSquare, Params, MaskPixelFunc );
+		Soy::Assert( Rgba->GetChannels() == 4, "Need input to have an alpha channel. SHould be set form opengl read" );
+		auto& RgbaMutable = *Rgba;
+		size_t ChangedPixelCount = 0;
+		MaskImage( RgbaMutable, *mPrevRgb, Keyframe, ImageRect, ChangedPixelCount, TestAlphaSquare, Params );
+		mChangedPixelCount += ChangedPixelCount;
+	}
+
+	//	nothing changed, ALL transparent
+	if ( ImageRect.IsEmpty() )
+		return false;
+
+	//	only palettise & encode the part that changed
+	ChangedRgba = Rgba;
+	if ( ImageRect.mWidth != Rgba->GetWidth() || ImageRect.mHeight != Rgba->GetHeight() )
+	{
+		ChangedRgba = mPixelsPool->Alloc( SoyPixelsMeta( ImageRect.mWidth, ImageRect.mHeight, Rgba->GetFormat() ) );
+		CropImage( *ChangedRgba, *Rgba, ImageRect );
 	}
+
+	//	save unmodifed frame
+	//	gr: should this store(accumulate) a flattened image, so comparison with prev is palettised, rather than original
+	mPrevRgb = Rgba;
+	mMaskedFrameCount++;
 	
+	return true;
+}
+
+
+bool Gif::TEncoder::MaskIndexes(TFrameBuffer& Frame,const SoyPixelsImpl& Rgba,size_t FrameWidth,size_t FrameHeight,bool& Keyframe,bool ForceKeyframe,const TEncodeParams& Params)
+{
+	//	debug output wants every index as it was chosen
+	//	canvas isn't kept up to date, so start again if masking comes back on
+	if ( !Params.mIndexMasking || Params.mDebugPalette || Params.mDebugIndexes || Params.mDebugTransparency )
+	{
+		mCanvasRgba.reset();
+		return true;
+	}
+
+	Soy::TScopeTimerPrint Timer( __func__, Gif::TimerMinMs );
+	auto& Rect = Frame.mRect;
+	auto& Palette = *Frame.mPalette;
+	auto& Indexes = *Frame.mIndexes;
+	auto TransparentIndex = Frame.mTransparentIndex;
+	Soy::Assert( Rgba.GetWidth() == Rect.mWidth && Rgba.GetHeight() == Rect.mHeight, "Palettised frame doesn't match its source" );
+	Soy::Assert( Rect.mLeft + Rect.mWidth <= FrameWidth && Rect.mTop + Rect.mHeight <= FrameHeight, "Palettised frame rect outside the frame" );
+
+	//	canvas is always the whole frame, started (or restarted for a new size) with nothing drawn. Pixels with 0 alpha
+	//	haven't been drawn by any frame, so we don't know what the decoder shows there and they're never masked
+	if ( !mCanvasRgba || mCanvasRgba->GetWidth() != FrameWidth || mCanvasRgba->GetHeight() != FrameHeight )
+	{
+		mCanvasRgba.reset( new SoyPixels() );
+		mCanvasRgba->Init( FrameWidth, FrameHeight, SoyPixelsFormat::RGBA );
+		auto& CanvasArray = mCanvasRgba->GetPixelsArray();
+		memset( CanvasArray.GetArray(), 0, CanvasArray.GetDataSize() );
+	}
+
+	bool Mask = !ForceKeyframe && Params.mAllowIntraFrames;
+
+	auto PaletteChannels = Palette.GetChannels();
+	auto PaletteSize = Palette.GetWidth();
+	auto* PalettePixels = Palette.GetPixelsArray().GetArray();
+	auto* IndexPixels = Indexes.GetPixelsArray().GetArray();
+	auto CanvasStride = mCanvasRgba->GetWidth() * 4;
+	auto* CanvasPixels = mCanvasRgba->GetPixelsArray().GetArray();
+	TPixelLayout Layout( Rgba.GetFormat() );
+	auto* SourcePixels = Rgba.GetPixelsArray().GetArray();
+
+	auto GetDiff = [](const uint8* Source,const TPixelLayout& Layout,const uint8* Colour)
+	{
+		return std::abs( Source[Layout.mRed] - Colour[0] ) + std::abs( Source[Layout.mGreen] - Colour[1] ) + std::abs( Source[Layout.mBlue] - Colour[2] );
+	};
+
+	//	bounds of what's still opaque
+	size_t MinX = Rect.mWidth;
+	size_t MinY = Rect.mHeight;
+	size_t MaxX = 0;
+	size_t MaxY = 0;
+	size_t MaskedCount = 0;
+	for ( size_t y=0;	y<Rect.mHeight;	y++ )
+	{
+		auto* CanvasRow = &CanvasPixels[ (Rect.mTop + y) * CanvasStride + Rect.mLeft * 4 ];
+		auto* IndexRow = &IndexPixels[ y * Rect.mWidth ];
+		auto* SourceRow = &SourcePixels[ y * Rect.mWidth * Layout.mChannels ];
+		for ( size_t x=0;	x<Rect.mWidth;	x++ )
+		{
+			auto Index = IndexRow[x];
+			if ( Index == TransparentIndex || Index >= PaletteSize )
+				continue;
+
+			auto* Colour = &PalettePixels[ Index * PaletteChannels ];
+			auto* Canvas = &CanvasRow[ x * 4 ];
+			//	the decoder already shows a colour at least as close as the one we picked
+			auto* Source = &SourceRow[ x * Layout.mChannels ];
+			if ( Mask && Canvas[3] != 0 && GetDiff( Source, Layout, Canvas ) <= GetDiff( Source, Layout, Colour ) )
+			{
+				IndexRow[x] = TransparentIndex;
+				MaskedCount++;
+				continue;
+			}
+
+			Canvas[0] = Colour[0];
+			Canvas[1] = Colour[1];
+			Canvas[2] = Colour[2];
+			Canvas[3] = 255;
+			MinX = std::min( MinX, x );
+			MinY = std::min( MinY, y );
+			MaxX = std::max( MaxX, x );
+			MaxY = std::max( MaxY, y );
+		}
+	}
+	mIndexMaskedPixelCount += MaskedCount;
+
+	if ( !Mask || MaskedCount == 0 )
+		return true;
+	Keyframe = false;
+
+	//	nothing left that the decoder doesn't already show
+	if ( MinX > MaxX || MinY > MaxY )
+		return false;
+
+	//	crop to what's left
+	TDirtyRect OpaqueRect( MinX, MinY, MaxX - MinX + 1, MaxY - MinY + 1 );
+	if ( OpaqueRect.mWidth != Rect.mWidth || OpaqueRect.mHeight != Rect.mHeight )
+	{
+		auto Cropped = mPixelsPool->Alloc( SoyPixelsMeta( OpaqueRect.mWidth, OpaqueRect.mHeight, Indexes.GetFormat() ) );
+		CropImage( *Cropped, Indexes, OpaqueRect );
+		Frame.mIndexes = Cropped;
+		Rect = TDirtyRect( Rect.mLeft + OpaqueRect.mLeft, Rect.mTop + OpaqueRect.mTop, OpaqueRect.mWidth, OpaqueRect.mHeight );
+	}
+	return true;
+}
+
+
+void Gif::TEncoder::MakePalettisedImage(TFrameBuffer& Frame,std::shared_ptr<SoyPixelsImpl> Rgba,bool& Keyframe,const char* IndexingShader,const TEncodeParams& Params)
+{
+	std::shared_ptr<SoyPixelsImpl> pNewPalette;
+
+	int TransparentIndex = 0;
+	int DebugTransparentIndex = 1;
+	Frame.mTransparentIndex = Params.mDebugTransparency ? DebugTransparentIndex : TransparentIndex;
+
+	bool AllowPaletteShortcuts = !Params.mDebugPalette && !Params.mDebugIndexes;
+
+	//	how far the colours have drifted from the last palette. Palettes are shared between frames as-is
+	std::shared_ptr<SoyPixelsImpl> PrevPalette;
+	size_t PrevPaletteMeanDiff = 0;
+	size_t PrevPaletteMaxDiff = 0;
+	size_t BaseMeanDiff = 0;
+	size_t BaseMaxDiff = 0;
+	bool PrevPaletteCheckedAll = false;
+	if ( AllowPaletteShortcuts && Params.mPaletteReuseMaxDiff > 0 )
+	{
+		std::lock_guard<std::mutex> Lock( mReusePaletteLock );
+		PrevPalette = mReusePalette;
+		BaseMeanDiff = mReusePaletteMeanDiff;
+		BaseMaxDiff = mReusePaletteMaxDiff;
+	}
+	if ( PrevPalette )
+		PrevPaletteCheckedAll = GetPaletteDrift( *PrevPalette, *Rgba, Params.mFindPalettePixelSkip, PrevPaletteMeanDiff, PrevPaletteMaxDiff );
+
+	auto ReusePalette = [&]
+	{
+		Frame.mPalette = PrevPalette;
+		Frame.mIndexes = IndexImageWithShader( PrevPalette, Rgba, IndexingShader );
+		Soy::Assert( Frame.mIndexes != nullptr, "Failed to make indexed image");
+		mReusedPaletteFrameCount++;
+	};
+
+	//	every colour is already in the palette. Only known if every pixel was checked, a sample could miss a new colour
+	//	that the exact palette below would have kept
+	if ( PrevPalette && PrevPaletteCheckedAll && PrevPaletteMaxDiff == 0 )
+	{
+		ReusePalette();
+		return;
+	}
+
+	//	few enough colours to index exactly, skip quantising
+	if ( Params.mExactPalette && AllowPaletteShortcuts )
+	{
+		auto ExactPalette = mPixelsPool->Alloc( SoyPixelsMeta( 256, 1, SoyPixelsFormat::RGBA ) );
+		auto ExactIndexes = mPixelsPool->Alloc( SoyPixelsMeta( Rgba->GetWidth(), Rgba->GetHeight(), SoyPixelsFormat::Greyscale ) );
+		if ( GetExactPalette( *ExactPalette, *ExactIndexes, *Rgba, Params ) )
+		{
+			if ( Params.mSortPalette )
+				SortPaletteByUse( *ExactPalette, *ExactIndexes, TransparentIndex );
+			Frame.mPalette = ExactPalette;
+			Frame.mIndexes = ExactIndexes;
+			mExactPaletteFrameCount++;
+			SetReusePalette( ExactPalette, 0, 0 );
+			return;
+		}
+	}
+
+	//	close enough, skip making a new palette. Drift is measured against how well the palette fitted the frame
+	//	it was made for, so quantisation error isn't counted. Max is allowed to be a bit worse than the mean so a
+	//	few pixels don't force a new palette, but new colours appearing (eg. a small object) will
+	auto MaxMeanDiff = static_cast<size_t>( Params.mPaletteReuseMaxDiff * 256.f * 3.f );
+	if ( PrevPalette && PrevPaletteMeanDiff <= BaseMeanDiff + MaxMeanDiff && PrevPaletteMaxDiff <= BaseMaxDiff + MaxMeanDiff * 4 )
+	{
+		ReusePalette();
+		return;
+	}
+
 	//	gr: this currently generates a full palette (can be > 256)
-	pNewPalette.reset( new SoyPixels );
+	pNewPalette = mPixelsPool->Alloc( SoyPixelsMeta( 256, 1, SoyPixelsFormat::RGBA ) );
 	GetPalette( *pNewPalette, *Rgba, Params, Keyframe );
-	
-	//	if the palette is empty... we're ALL transparent!
+
+	//	the pixel skip can step over every changed pixel in a small rect, but masking says there's something there
 	if ( pNewPalette->GetWidth() == 0 )
-		return false;
+	{
+		auto AllPixelParams = Params;
+		AllPixelParams.mFindPalettePixelSkip = 0;
+		GetPalette( *pNewPalette, *Rgba, AllPixelParams, Keyframe );
+	}
+	Soy::Assert( pNewPalette->GetWidth() > 0, "Palette of changed pixels is empty" );
 
 	//	gr: sort & shrink palette here, don't use lookup table
-	ShrinkPalette( *pNewPalette, false, Params );
+	//	histogram palettes already come out at size with the forced colours in
+	bool HistogramPalette = ( Params.mPaletteHistogramBits != 0 ) && !Params.mDebugPalette;
+	if ( !HistogramPalette )
+		ShrinkPalette( *pNewPalette, false, Params, *mPaletteTasks );
 		
 	//	insert/override transparent
 	pNewPalette->SetPixel( TransparentIndex, 0, Params.mTransparentColour );
@@ -1091,29 +2516,34 @@ bool Gif::TEncoder::MakePalettisedImage(SoyPixelsImpl& PalettisedImage,const Soy
 	std::shared_ptr<SoyPixelsImpl> pIndexedImage = IndexImageWithShader( pNewPalette, Rgba, IndexingShader );
 	Soy::Assert(pIndexedImage != nullptr, "Failed to make indexed image");
 
-	//	save unmodifed frame
-	//	gr: should this store(accumulate) a flattened image, so comparison with prev is palettised, rather than original
-	mPrevRgb = Rgba;
-	
-	//	join together
-	Soy::TScopeTimerPrint Timer("MakePaletteised",Gif::TimerMinMs);
-	auto WriteTransparentIndex = Params.mDebugTransparency ? DebugTransparentIndex : TransparentIndex;
-	SoyPixelsFormat::MakePaletteised( PalettisedImage, *pIndexedImage, *pNewPalette, WriteTransparentIndex );
-	
-	return true;
-}
+	//	nothing else has the palette yet, so it can still be reordered
+	if ( Params.mSortPalette && AllowPaletteShortcuts )
+		SortPaletteByUse( *pNewPalette, *pIndexedImage, TransparentIndex );
 
-bool Gif::TEncoder::CanPushFrame(SoyTime Timecode)
-{
-	//	if skipping and we have something pending, skip this one
-	if ( mSkipFrames )
+	//	muxer writes these straight out
+	Frame.mPalette = pNewPalette;
+	Frame.mIndexes = pIndexedImage;
+
+	if ( AllowPaletteShortcuts && Params.mPaletteReuseMaxDiff > 0 )
 	{
-		static int MaxPending = 1;
-		auto PendingCount = mPendingFrames.GetSize();
-		if ( PendingCount >= MaxPending )
-			return false;
+		//	how well it fits its own frame, from the indexes we already have rather than searching again
+		size_t MeanDiff,MaxDiff;
+		GetIndexedDrift( *pNewPalette, *pIndexedImage, *Rgba, TransparentIndex, Params.mFindPalettePixelSkip, MeanDiff, MaxDiff );
+		SetReusePalette( pNewPalette, MeanDiff, MaxDiff );
 	}
+}
 
+void Gif::TEncoder::SetReusePalette(std::shared_ptr<SoyPixelsImpl> Palette,size_t MeanDiff,size_t MaxDiff)
+{
+	//	palettise jobs can finish out of order, so this is just the most recent palette made, not necessarily the previous frame's
+	std::lock_guard<std::mutex> Lock( mReusePaletteLock );
+	mReusePalette = Palette;
+	mReusePaletteMeanDiff = MeanDiff;
+	mReusePaletteMaxDiff = MaxDiff;
+}
+
+bool Gif::TEncoder::CanPushFrame(SoyTime Timecode)
+{
 #if defined(ENABLE_DIRECTX)
 	//	pool is full (and other OOM checks)
 	if ( mDirectxGifBlitter )
@@ -1129,6 +2559,105 @@ bool Gif::TEncoder::CanPushFrame(SoyTime Timecode)
 			return false;
 	}
 
+	//	after the pool checks, so a frame we can't copy doesn't use up a slot
+	if ( !IsFrameDue(Timecode) )
+		return false;
+
+	if ( !CanQueueFrame() )
+		return false;
+
+	return true;
+}
+
+bool Gif::TEncoder::CanQueueFrame()
+{
+	auto MaxPending = mParams.mMaxPendingFrames;
+
+	switch ( mParams.mQueuePolicy )
+	{
+		//	the new frame always wins, so it has to be copied. Making room happens as it's pushed, and the
+		//	frame that loses out is only ever copied, never read back
+		case TQueuePolicy::DropOldest:
+			return true;
+
+		case TQueuePolicy::KeepEveryNth:
+		{
+			auto HalfFull = ( MaxPending + 1 ) / 2;
+			if ( mPendingFrames->GetSize() < HalfFull )
+			{
+				mQueueKeepCounter = 0;
+				break;
+			}
+
+			auto KeepEvery = std::max<size_t>( 1, mParams.mQueueKeepEvery );
+			if ( ( mQueueKeepCounter++ % KeepEvery ) != 0 )
+			{
+				mThinnedFrameCount++;
+				return false;
+			}
+			break;
+		}
+
+		case TQueuePolicy::Block:
+		{
+			//	this is the writer's thread, before any copying, never a graphics job the encoder thread might be waiting on
+			std::unique_lock<std::mutex> Lock( mQueueSpaceLock );
+			auto HasSpace = [this,MaxPending]
+			{
+				return mPendingFrames->GetSize() < MaxPending || !IsWorking();
+			};
+			auto Timeout = std::chrono::milliseconds( mParams.mQueueBlockTimeoutMs );
+			if ( !mQueueSpaceChanged.wait_for( Lock, Timeout, HasSpace ) )
+			{
+				mBlockTimeoutFrameCount++;
+				return false;
+			}
+			return true;
+		}
+
+		default:
+			break;
+	}
+
+	if ( mPendingFrames->GetSize() >= MaxPending )
+	{
+		mDroppedNewestFrameCount++;
+		return false;
+	}
+	return true;
+}
+
+bool Gif::TEncoder::IsFrameDue(SoyTime Timecode)
+{
+	//	gif delays can't be under 20ms (see TMuxer::GetHeldFrameDelay), so frames any closer would make written time
+	//	run ahead of real time. Dropping them here, before masking, folds their changes into the next frame we take
+	static size_t MaxFrameRate = 50;
+
+	//	frames come in at the game's rate, only take as many as we'll write
+	auto FrameRate = ( mParams.mFrameRate == 0 ) ? MaxFrameRate : std::min( mParams.mFrameRate, MaxFrameRate );
+
+	std::lock_guard<std::mutex> Lock( mFrameRateLock );
+	if ( !mFrameRateStarted )
+	{
+		mFrameRateStarted = true;
+		mFrameRateStartTimecode = Timecode;
+		mFrameRateNextFrame = 1;
+		return true;
+	}
+
+	//	position in 1000ths of an output frame. Frames up to a quarter of a frame early are taken, so timestamp
+	//	jitter doesn't make us wait for the next game frame
+	static int64_t EarlyTolerance = 250;
+	auto Elapsed = Timecode.GetDiff( mFrameRateStartTimecode );
+	auto Position = Elapsed * static_cast<int64_t>( FrameRate ) + EarlyTolerance;
+	if ( Position < static_cast<int64_t>( mFrameRateNextFrame * 1000 ) )
+	{
+		mDecimatedFrameCount++;
+		return false;
+	}
+
+	//	if we stalled, skip the frames we missed rather than catching up with a burst
+	mFrameRateNextFrame = static_cast<size_t>( Position / 1000 ) + 1;
 	return true;
 }
 
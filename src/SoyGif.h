@@ -2,6 +2,7 @@
 
 #include <SoyTypes.h>
 #include <SoyMedia.h>
+#include <condition_variable>
 
 
 class GifWriter;
@@ -29,11 +30,45 @@ namespace Gif
 	class TMuxer;
 	class TEncoder;
 	class TEncodeParams;
+	class TDirtyRect;
+	class TPixelLayout;
+	class TFrameBuffer;
+	class TOrderedJobPool;
+	class TTaskPool;
+	class TIndexLookupCache;
+	class TIndexLookupTable;
+	class TPixelsPool;
+	class TQualityGovernor;
+	template<typename TYPE>
+	class TSpscRing;
+
+	//	what the encoder does with new frames when mMaxPendingFrames are already waiting
+	namespace TQueuePolicy
+	{
+		enum Type
+		{
+			DropNewest,		//	refuse new frames
+			DropOldest,		//	lose the oldest waiting frame, so the latest is always encoded
+			KeepEveryNth,	//	once half full, only keep every Nth frame so drops are spread out. Drops newest when full
+			Block,			//	writer waits (up to a timeout) for space
+		};
+
+		inline const char*	ToString(Type Policy)
+		{
+			switch ( Policy )
+			{
+				case DropNewest:	return "DropNewest";
+				case DropOldest:	return "DropOldest";
+				case KeepEveryNth:	return "KeepEveryNth";
+				case Block:			return "Block";
+			}
+			return "Unknown";
+		}
+	}
 	
 	std::shared_ptr<TMediaEncoder>	AllocEncoder(std::shared_ptr<TMediaPacketBuffer> OutputBuffer,size_t StreamIndex,std::shared_ptr<Opengl::TContext> Context,std::shared_ptr<TPool<Opengl::TTexture>> TexturePool,const TEncodeParams& Params,bool SkipFrames);
 	std::shared_ptr<TMediaEncoder>	AllocEncoder(std::shared_ptr<TMediaPacketBuffer> OutputBuffer,size_t StreamIndex,std::shared_ptr<Directx::TContext> Context,std::shared_ptr<TPool<Directx::TTexture>> TexturePool,const TEncodeParams& Params,bool SkipFrames);
-
-	typedef std::function<bool(const vec3x<uint8>& Old,const vec3x<uint8>& New)>	TMaskPixelFunc;
+	std::shared_ptr<TMediaEncoder>	AllocEncoder(std::shared_ptr<TMediaPacketBuffer> OutputBuffer,size_t StreamIndex,const TEncodeParams& Params,bool SkipFrames);
 }
 
 
@@ -46,15 +81,40 @@ public:
 		mDebugPalette			( false ),
 		mDebugTransparency		( false ),
 		mFindPalettePixelSkip	( 5 ),
+		mPaletteHistogramBits	( 5 ),
+		mExactPalette			( true ),
+		mPaletteReuseMaxDiff	( 0.f ),
+		mGlobalPalette			( false ),
 		mTransparentColour		( 255, 0, 255 ),
 		mMaxColours				( 255 ),
 		mMaskMaxDiff			( 0.f / 256.f ),
 		mCpuOnly				( false ),
-		mLzwCompression			( true )
+		mLzwCompression			( true ),
+		mIndexLookupBits		( 0 ),
+		mLzwThreadCount			( 2 ),
+		mPalettiseThreadCount	( 2 ),
+		mPaletteSplitThreadCount	( 0 ),
+		mFrameRate				( 0 ),
+		mAdaptiveQuality		( false ),
+		mMaxPendingFrames		( 8 ),
+		mQueuePolicy			( TQueuePolicy::DropNewest ),
+		mQueueKeepEvery			( 2 ),
+		mQueueBlockTimeoutMs	( 100 ),
+		mKeyframeIntervalFrames	( 0 ),
+		mKeyframeIntervalMs		( 0 ),
+		mScale					( 1.f ),
+		mMaxWidth				( 0 ),
+		mMaxHeight				( 0 ),
+		mIndexMasking			( false ),
+		mSortPalette			( false )
 	{
 	}
 
 	size_t			mFindPalettePixelSkip;	//	when generating pallete, reduce number of colours we accumualte
+	size_t			mPaletteHistogramBits;	//	build palette from a (2^bits)^3 colour histogram (4-6). 0 = median cut every sampled pixel
+	bool			mExactPalette;			//	frames with fewer colours than the palette holds skip quantising and are indexed losslessly
+	float			mPaletteReuseMaxDiff;	//	reuse the last palette if a frame's mean error against it is under this (of 256*3, like mMaskMaxDiff). 0 = new palette every frame. 6/768 is a good start
+	bool			mGlobalPalette;			//	first palette goes in the header, frames using the same palette don't write their own
 	bool			mAllowIntraFrames;		//	use transparency between frames
 	bool			mDebugPalette;			//	make a debug palette
 	bool			mDebugIndexes;			//	render the pallete top to bottom
@@ -64,16 +124,119 @@ public:
 	float			mMaskMaxDiff;			//	if zero, exact pixel colour matches required
 	bool			mCpuOnly;				//	no gpu stuff. good for debugging muxer etc
 	bool			mLzwCompression;
+	size_t			mIndexLookupBits;		//	cpu indexing uses a (2^bits)^3 rgb->index table cached per palette, approximate (nearest to each cell centre). 0 = exact search every pixel
+	size_t			mLzwThreadCount;		//	muxer compresses this many frames at once. 0 = on the muxer thread
+	size_t			mPalettiseThreadCount;	//	encoder palettises & indexes this many frames at once. 0 = on the encoder thread
+	size_t			mPaletteSplitThreadCount;	//	extra threads big median cuts (mPaletteHistogramBits 0) split their subtrees over. 0 = none
+	size_t			mFrameRate;				//	frames written per second, others are dropped before they're copied or read back. 0 = every frame, up to 50 a second (gif's shortest delay)
+	bool			mAdaptiveQuality;		//	trade palette & masking quality for speed when frames back up or can't keep up with mFrameRate
+	size_t			mMaxPendingFrames;		//	frames waiting for the encoder thread before mQueuePolicy kicks in
+	TQueuePolicy::Type	mQueuePolicy;
+	size_t			mQueueKeepEvery;		//	TQueuePolicy::KeepEveryNth's N
+	size_t			mQueueBlockTimeoutMs;	//	TQueuePolicy::Block gives up and drops the frame after this long
+	size_t			mKeyframeIntervalFrames;	//	write a full opaque frame after this many frames, so decoding can start there. 0 = never
+	size_t			mKeyframeIntervalMs;	//	same, but by time. 0 = never
+	float			mScale;					//	downscale frames before they're masked & palettised. 1 = source size
+	size_t			mMaxWidth;				//	also downscale (keeping aspect ratio) to fit these. 0 = no limit
+	size_t			mMaxHeight;
+	bool			mIndexMasking;			//	after palettising, pixels where the canvas already shows as close a colour as the palette's become transparent
+	bool			mSortPalette;			//	new palettes list their most used colours first, so frames sharing them can use smaller lzw codes
 	BufferArray<Soy::TRgb8,10>	mForcedPaletteColours;	//	for watermark, ensure these colours exist
 };
 
 
 
+//	where the colour channels are in the formats the cpu stages read directly (RGB, BGR, RGBA, BGRA),
+//	so frames don't need converting to RGBA first. Alpha is always the 4th channel
+class Gif::TPixelLayout
+{
+public:
+	TPixelLayout(SoyPixelsFormat::Type Format);		//	throws for other formats
+
+	static bool	IsSupported(SoyPixelsFormat::Type Format);
+
+public:
+	size_t		mChannels;
+	size_t		mRed;
+	size_t		mGreen;
+	size_t		mBlue;
+	bool		mHasAlpha;
+};
+
+
+//	region of the canvas a frame covers
+class Gif::TDirtyRect
+{
+public:
+	TDirtyRect() :
+		mLeft	( 0 ),
+		mTop	( 0 ),
+		mWidth	( 0 ),
+		mHeight	( 0 )
+	{
+	}
+	TDirtyRect(size_t Left,size_t Top,size_t Width,size_t Height) :
+		mLeft	( Left ),
+		mTop	( Top ),
+		mWidth	( Width ),
+		mHeight	( Height )
+	{
+	}
+
+	bool		IsEmpty() const		{	return mWidth == 0 || mHeight == 0;	}
+
+public:
+	size_t		mLeft;
+	size_t		mTop;
+	size_t		mWidth;
+	size_t		mHeight;
+};
+
+
+//	attached to encoded packets (as the pixel buffer) carrying the palettised image; packet mData is left empty.
+//	The image may only be the changed part of the canvas, mRect says where it goes
+class Gif::TFrameBuffer : public TPixelBuffer
+{
+public:
+	TFrameBuffer(const TDirtyRect& Rect) :
+		mRect				( Rect ),
+		mTransparentIndex	( 0 )
+	{
+	}
+
+	//	palette & index planes, same order as SplitPlanes
+	virtual void	Lock(ArrayBridge<Opengl::TTexture>&& Textures,Opengl::TContext& Context,float3x3& Transform) override	{}
+	virtual void	Lock(ArrayBridge<Directx::TTexture>&& Textures,Directx::TContext& Context,float3x3& Transform) override	{}
+	virtual void	Lock(ArrayBridge<Metal::TTexture>&& Textures,Metal::TContext& Context,float3x3& Transform) override		{}
+	virtual void	Lock(ArrayBridge<SoyPixelsImpl*>&& Textures,float3x3& Transform) override
+	{
+		if ( !HasPlanes() )
+			return;
+		Textures.PushBack( mPalette.get() );
+		Textures.PushBack( mIndexes.get() );
+	}
+	virtual void	Unlock() override	{}
+
+	bool			HasPlanes() const	{	return mPalette && mIndexes;	}
+
+public:
+	TDirtyRect		mRect;
+	//	planes are shared, not packed into the packet data, so they go from the encoder to lzw without copies
+	std::shared_ptr<SoyPixelsImpl>	mPalette;
+	std::shared_ptr<SoyPixelsImpl>	mIndexes;		//	greyscale
+	size_t			mTransparentIndex;
+};
+
+
 class Gif::TMuxer : public TMediaMuxer
 {
 public:
 	TMuxer(std::shared_ptr<TStreamWriter>& Output,std::shared_ptr<TMediaPacketBuffer>& Input,const std::string& ThreadName,const TEncodeParams& Params);
 	~TMuxer();
+
+	virtual void			GetMeta(TJsonWriter& Json) override;
+	size_t					GetKeyframeOffsets(ArrayBridge<size_t>&& Offsets);	//	returns the header size
+	void					SetEncoder(std::shared_ptr<TMediaEncoder> Encoder);	//	told to resync when a frame fails to compress
 	
 protected:
 	virtual void			Finish() override;
@@ -82,14 +245,39 @@ protected:
 
 	void					WriteToBuffer(const ArrayBridge<uint8>&& Data);
 	void					FlushBuffer();
+	void					WriteHeader(const SoyPixelsImpl* GlobalPalette);
+	void					PushWrite(std::shared_ptr<Soy::TWriteProtocol> Write,bool Keyframe);
+	void					WriteFrame(std::shared_ptr<TMediaPacket> Packet,uint16 Delay);
+	uint16					GetHeldFrameDelay(SoyTime NextTimecode);
 	
 public:
 	bool						mLzwCompression;
+	bool						mGlobalPaletteEnabled;
+	std::shared_ptr<SoyPixelsImpl>	mGlobalPalette;		//	first frame's palette, in the header
+	TEncodeParams				mParams;			//	the encoder's, so the canvas matches its downscaled frames
+	SoyPixelsMeta				mCanvasMeta;
+	bool						mHeaderWritten;
+	std::shared_ptr<TOrderedJobPool>	mLzwJobs;			//	frames are compressed in parallel and written in order
 	std::mutex					mBusy;
 	std::atomic<bool>			mStarted;
 	std::atomic<bool>			mFinished;
 	
-	SoyTime						mPrevImageTimecode;		//	for accurate frame duration at muxer level
+	std::shared_ptr<TMediaPacket>	mHeldPacket;		//	latest frame, written when the next arrives and we know its duration
+	SoyTime						mFirstTimecode;
+	size_t						mWrittenDelay;			//	100ths of a second written so far
+	size_t						mFrameCount;			//	frames received, including the held one
+
+	//	a frame that fails to compress leaves the encoder's later frames masked against pixels the decoder never got
+	std::mutex					mEncoderLock;
+	std::weak_ptr<TEncoder>		mEncoder;
+	std::atomic<size_t>			mFailedFrameCount;		//	frames that failed to compress, and those dropped after them
+	bool						mDroppingUntilKeyframe;	//	output order only
+
+	//	a late joiner (or replay, or trim) can decode from the header followed by the stream from any keyframe offset
+	std::mutex					mKeyframeOffsetsLock;
+	size_t						mHeaderSize;			//	bytes
+	size_t						mWrittenSize;			//	bytes
+	Array<size_t>				mKeyframeOffsets;		//	bytes, from the start of the file
 };
 
 
@@ -107,9 +295,16 @@ public:
 class TCpuGifBlitter : public TGifBlitter
 {
 public:
+	TCpuGifBlitter(size_t IndexLookupBits,std::shared_ptr<Gif::TPixelsPool> PixelsPool);
+	
 	virtual std::shared_ptr<SoyPixelsImpl>	IndexImageWithShader(std::shared_ptr<SoyPixelsImpl> Palette,std::shared_ptr<SoyPixelsImpl> Source,const char* FragShader,std::shared_ptr<Soy::TSemaphore> JobSempahore) override;
 
+	void				IndexImage(const SoyPixelsImpl& Palette,const SoyPixelsImpl& Source,SoyPixelsImpl& IndexedImage);
+	void				IndexImage(const Gif::TIndexLookupTable& LookupTable,const SoyPixelsImpl& Source,SoyPixelsImpl& IndexedImage);
+
 public:
+	std::shared_ptr<Gif::TIndexLookupCache>	mLookupCache;
+	std::shared_ptr<Gif::TPixelsPool>		mPixelsPool;	//	indexed images come from here
 };
 
 class Opengl::GifBlitter : public TGifBlitter
@@ -160,7 +355,8 @@ public:
 	virtual void			Write(const Directx::TTexture& Image,SoyTime Timecode,Directx::TContext& Context) override;
 	virtual void			Write(std::shared_ptr<SoyPixelsImpl> Image,SoyTime Timecode) override;
 	virtual void			GetMeta(TJsonWriter& Json) override;
-	virtual size_t			GetPendingEncodeCount() const override	{	return mPendingFrames.GetSize();	}
+	virtual size_t			GetPendingEncodeCount() const override;
+	void					Resync()	{	mResyncPending = true;	}	//	a frame was lost after output, so force the next to be a keyframe
 
 protected:
 	virtual bool					CanSleep() override;
@@ -171,34 +367,84 @@ protected:
 	Opengl::TContext&		GetOpenglContext();
 	Directx::TContext&		GetDirectxContext();
 
-	//	if this returns false, we're ALL transparent
-	bool					MakePalettisedImage(SoyPixelsImpl& PalettisedImage,const SoyPixelsImpl& Rgba,bool& IsKeyframe,const char* IndexingShader,const TEncodeParams& Params,TMaskPixelFunc MaskPixelFunc);
+	//	sequential; masks against the previous frame and crops to the changed pixels (ImageRect). if this returns false, we're ALL transparent.
+	//	Rgba is masked in place if OwnsRgba, otherwise it's copied first
+	bool					MaskFrame(std::shared_ptr<SoyPixelsImpl>& ChangedRgba,TDirtyRect& ImageRect,std::shared_ptr<SoyPixelsImpl>& Rgba,bool OwnsRgba,bool& IsKeyframe,bool ForceKeyframe,const TEncodeParams& Params);
+	bool					IsKeyframeDue(SoyTime Timecode);
+	//	in output order; masks indexes where the canvas the previous frames leave is already as close to Rgba, and crops to what's left. false if nothing is
+	bool					MaskIndexes(TFrameBuffer& Frame,const SoyPixelsImpl& Rgba,size_t FrameWidth,size_t FrameHeight,bool& IsKeyframe,bool ForceKeyframe,const TEncodeParams& Params);
+	std::shared_ptr<SoyPixelsImpl>	DownscaleFrame(std::shared_ptr<SoyPixelsImpl> Rgba,const TEncodeParams& Params);
+	//	thread safe, runs on the palettise jobs
+	void					MakePalettisedImage(TFrameBuffer& Frame,std::shared_ptr<SoyPixelsImpl> Rgba,bool& IsKeyframe,const char* IndexingShader,const TEncodeParams& Params);
 	std::shared_ptr<SoyPixelsImpl>	IndexImageWithShader(std::shared_ptr<SoyPixelsImpl> Palette,std::shared_ptr<SoyPixelsImpl> Source,const char* FragShader);
 	
 	bool					CanPushFrame(SoyTime Timecode);
+	bool					IsFrameDue(SoyTime Timecode);
+	bool					CanQueueFrame();		//	applies mQueuePolicy before a frame is copied. May block
 	void					OnFramePrePushSkipped(SoyTime Timcode);
 
 private:
+	void								AllocPalettiseJobs();
+	void								AllocPendingFrames();
+	void								SetReusePalette(std::shared_ptr<SoyPixelsImpl> Palette,size_t MeanDiff,size_t MaxDiff);
 	std::shared_ptr<Soy::TSemaphore>	AllocJobSempahore();
 	void								AbortJobSemaphores();
 
 public:
-	size_t					mPushedFrameCount;
+	std::atomic<size_t>		mPushedFrameCount;
+	std::atomic<size_t>		mExactPaletteFrameCount;	//	frames that skipped quantising
+	std::atomic<size_t>		mReusedPaletteFrameCount;	//	frames that used the last palette
+	std::atomic<size_t>		mUnchangedFrameCount;	//	frames dropped by masking, shown by extending the previous frame
+	std::atomic<size_t>		mFailedFrameCount;		//	frames that failed to palettise, and those masked against them
+	std::atomic<size_t>		mDecimatedFrameCount;	//	frames dropped to keep to mParams.mFrameRate (or gif's max)
+	std::atomic<size_t>		mDroppedNewestFrameCount;	//	new frames refused by a full queue
+	std::atomic<size_t>		mDroppedOldestFrameCount;	//	waiting frames thrown away by TQueuePolicy::DropOldest
+	std::atomic<size_t>		mThinnedFrameCount;		//	frames skipped by TQueuePolicy::KeepEveryNth
+	std::atomic<size_t>		mBlockTimeoutFrameCount;	//	frames dropped after TQueuePolicy::Block timed out
+	std::atomic<size_t>		mChangedPixelCount;		//	opaque pixels left after masking, over all frames
+	std::atomic<size_t>		mIndexMaskedPixelCount;	//	of those, made transparent again by mParams.mIndexMasking
+	size_t					mMaskedFrameCount;		//	frames that got past masking, on the encoder thread
+	bool					mKeyframeMasked;		//	there's been a keyframe, and these are the last one's
+	size_t					mLastKeyframeIndex;		//	mMaskedFrameCount
+	SoyTime					mLastKeyframeTimecode;
+	std::atomic<bool>		mResyncPending;			//	a frame failed to palettise (or compress), force the next one to be a keyframe
+	bool					mDroppingUntilResync;	//	output order only. Frames masked before the resync keyframe are dropped
 	Gif::TEncodeParams		mParams;
 	bool					mSkipFrames;
 	size_t					mStreamIndex;
 	
+	std::mutex				mFrameRateLock;
+	bool					mFrameRateStarted;
+	SoyTime					mFrameRateStartTimecode;
+	size_t					mFrameRateNextFrame;	//	frame index (from mFrameRateStartTimecode) we want next
+
+	//	only the encoder thread pops. Frames are pushed from whichever thread finished copying them, so pushes take the lock.
+	//	TQueuePolicy::DropOldest pushes pop the oldest frame to make room, so in that mode the encoder pops under the lock too
 	std::mutex				mPendingFramesLock;
-	Array<std::shared_ptr<TMediaPacket>>	mPendingFrames;
+	std::shared_ptr<TSpscRing<std::shared_ptr<TMediaPacket>>>	mPendingFrames;
+	std::atomic<size_t>		mQueueKeepCounter;		//	TQueuePolicy::KeepEveryNth frames since the queue got half full
+	std::mutex				mQueueSpaceLock;		//	TQueuePolicy::Block writers wait on mQueueSpaceChanged
+	std::condition_variable	mQueueSpaceChanged;
 	
+	//	readback, crop, palette & index pixels are recycled through here (and return to it when the muxer is done)
+	std::shared_ptr<TPixelsPool>			mPixelsPool;
+	std::shared_ptr<TQualityGovernor>		mQualityGovernor;	//	null if mParams.mAdaptiveQuality is off
 
 	std::shared_ptr<Opengl::GifBlitter>		mOpenglGifBlitter;
-	std::shared_ptr<TGifBlitter>			mCpuGifBlitter;
+	std::shared_ptr<TCpuGifBlitter>		mCpuGifBlitter;
 #if defined(ENABLE_DIRECTX)
 	std::shared_ptr<Directx::GifBlitter>	mDirectxGifBlitter;
 #endif
 
 	std::shared_ptr<SoyPixelsImpl>			mPrevRgb;
+	std::shared_ptr<SoyPixelsImpl>			mCanvasRgba;		//	what a decoder shows after the frames output so far, 0 alpha where nothing's drawn yet. Only touched in output order
+	std::shared_ptr<TTaskPool>				mPaletteTasks;		//	median cut subtrees, shared by the palettise jobs (so has to outlive them)
+	std::shared_ptr<TOrderedJobPool>		mPalettiseJobs;		//	palette & indexing of masked frames
+
+	std::mutex								mReusePaletteLock;
+	std::shared_ptr<SoyPixelsImpl>			mReusePalette;		//	latest palette, frames that haven't drifted far from it reuse it
+	size_t									mReusePaletteMeanDiff;	//	error of mReusePalette against the frame it was made for
+	size_t									mReusePaletteMaxDiff;
 
 private:
 	//	when unity destructs us, the opengl thread is suspended, so we need to forcily break a semaphore
@@ -0,0 +1,126 @@
+#pragma once
+
+//	closed loop over encoding cost. When frames queue up, or take longer than the frame rate allows, the encoder
+//	steps down to cheaper settings (sparser palette sampling, fewer colours, looser masking) and steps back up
+//	once there's headroom again, rather than mPendingFrames growing until we run out of memory.
+//	Each frame takes a copy of the params with the level applied, so jobs in flight aren't affected by a change.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include <SoyTypes.h>
+#include <mutex>
+#include <atomic>
+#include "SoyGif.h"
+
+
+namespace Gif
+{
+	class TQualityGovernor;
+}
+
+
+class Gif::TQualityGovernor
+{
+public:
+	static const size_t	LevelCount = 5;
+
+public:
+	TQualityGovernor(size_t FrameRate,size_t ThreadCount) :
+		mLevel				( 0 ),
+		mFrameIntervalMs	( FrameRate == 0 ? 0.f : 1000.f / FrameRate ),
+		mThreadCount		( std::max<size_t>( 1, ThreadCount ) ),
+		mMaxQueueDepth		( std::max<size_t>( 1, ThreadCount ) + 2 ),
+		mAverageEncodeMs	( 0.f ),
+		mEncodedFrameCount	( 0 ),
+		mFramesSinceChange	( 0 ),
+		mFramesWithHeadroom	( 0 )
+	{
+	}
+
+	//	params for the next frame at the current level. Only ever makes them cheaper than configured
+	TEncodeParams	GetParams(const TEncodeParams& Params) const
+	{
+		static const size_t PixelSkipScale[LevelCount] = { 1, 2, 4, 8, 16 };
+		static const size_t MaxColours[LevelCount] = { 255, 255, 128, 64, 32 };
+		static const float MaskMaxDiff[LevelCount] = { 0.f, 2.f/256.f, 4.f/256.f, 8.f/256.f, 16.f/256.f };
+
+		size_t Level = mLevel;
+		auto LevelParams = Params;
+		if ( Level == 0 )
+			return LevelParams;
+
+		LevelParams.mFindPalettePixelSkip = std::max<size_t>( 1, Params.mFindPalettePixelSkip ) * PixelSkipScale[Level];
+		//	always room for the transparent & forced colours
+		auto MinColours = 2 + Params.mForcedPaletteColours.GetSize();
+		LevelParams.mMaxColours = std::min( Params.mMaxColours, std::max( MaxColours[Level], MinColours ) );
+		LevelParams.mMaskMaxDiff = std::max( Params.mMaskMaxDiff, MaskMaxDiff[Level] );
+		return LevelParams;
+	}
+
+	//	once per frame on the encoder thread, with how many frames are waiting (pending & palettising)
+	void			OnFrameQueued(size_t QueueDepth)
+	{
+		//	frames to let a change take effect before stepping down again, and how long we need headroom before stepping up
+		static size_t StepDownFrames = 4;
+		static size_t StepUpFrames = 30;
+		//	stepping up makes frames more expensive, so only do it when they're well under budget
+		static float StepUpHeadroom = 2.f;
+
+		std::lock_guard<std::mutex> Lock( mLock );
+		mFramesSinceChange++;
+
+		//	jobs run side by side, so a frame costs its encode time split over the threads
+		auto FrameCostMs = mAverageEncodeMs / mThreadCount;
+		bool HasInterval = mFrameIntervalMs > 0.f && mEncodedFrameCount > 0;
+
+		bool Behind = ( QueueDepth > mMaxQueueDepth ) || ( HasInterval && FrameCostMs > mFrameIntervalMs );
+		bool Headroom = ( QueueDepth <= 1 ) && ( !HasInterval || FrameCostMs * StepUpHeadroom < mFrameIntervalMs );
+
+		mFramesWithHeadroom = Headroom ? mFramesWithHeadroom+1 : 0;
+
+		if ( Behind && mLevel+1 < LevelCount && mFramesSinceChange >= StepDownFrames )
+		{
+			mLevel++;
+			mFramesSinceChange = 0;
+			mFramesWithHeadroom = 0;
+		}
+		else if ( mLevel > 0 && mFramesWithHeadroom >= StepUpFrames )
+		{
+			mLevel--;
+			mFramesSinceChange = 0;
+			mFramesWithHeadroom = 0;
+		}
+	}
+
+	//	from any thread when a frame has been masked & palettised
+	void			OnFrameEncoded(float EncodeMs)
+	{
+		static float AverageWeight = 0.25f;
+
+		std::lock_guard<std::mutex> Lock( mLock );
+		if ( mEncodedFrameCount == 0 )
+			mAverageEncodeMs = EncodeMs;
+		else
+			mAverageEncodeMs += ( EncodeMs - mAverageEncodeMs ) * AverageWeight;
+		mEncodedFrameCount++;
+	}
+
+	size_t			GetLevel() const	{	return mLevel;	}
+
+	float			GetAverageEncodeMs()
+	{
+		std::lock_guard<std::mutex> Lock( mLock );
+		return mAverageEncodeMs;
+	}
+
+private:
+	std::atomic<size_t>	mLevel;				//	0 = as configured, higher is cheaper
+	float				mFrameIntervalMs;	//	0 = no frame rate, go by queue depth only
+	size_t				mThreadCount;
+	size_t				mMaxQueueDepth;
+
+	std::mutex			mLock;
+	float				mAverageEncodeMs;
+	size_t				mEncodedFrameCount;
+	size_t				mFramesSinceChange;
+	size_t				mFramesWithHeadroom;
+};
@@ -0,0 +1,447 @@
+#pragma once
+
+//	pool of worker threads that run jobs in parallel but deliver their results in the order the jobs were pushed.
+//	gif frames are independent once they've been palettised/masked, so we can spread them over cores,
+//	but the stream has to come out in frame order.
+//	TTaskPool is the unordered fork/join version, for splitting up the work within a frame.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include <SoyTypes.h>
+#include <SoyThread.h>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <sstream>
+
+
+namespace Gif
+{
+	class TOrderedJobPool;
+	class TOrderedJobWorker;
+	class TTaskPool;
+	class TTaskWorker;
+}
+
+
+class Gif::TOrderedJobPool
+{
+	friend class TOrderedJobWorker;
+public:
+	class TJob
+	{
+	public:
+		TJob() :
+			mStarted	( false ),
+			mFinished	( false ),
+			mRunFailed	( false )
+		{
+		}
+
+		void					Run();
+
+		std::function<void()>	mRun;		//	runs on any worker
+		std::function<void()>	mOutput;	//	runs after mRun, in push order, one at a time
+		std::function<void(const std::string&)>	mFailed;	//	instead of mOutput if mRun threw. Optional
+		bool					mStarted;
+		bool					mFinished;
+		bool					mRunFailed;
+		std::string				mError;
+	};
+
+public:
+	//	WorkerCount of 0 runs jobs immediately on the pushing thread
+	TOrderedJobPool(const std::string& Name,size_t WorkerCount,size_t MaxPendingJobs);
+	~TOrderedJobPool();
+
+	//	blocks whilst MaxPendingJobs are in flight. If Run throws, Output is skipped and Failed runs in its place
+	void				Push(std::function<void()> Run,std::function<void()> Output,std::function<void(const std::string&)> Failed=nullptr);
+	void				Flush();		//	block until everything pushed has been output
+	size_t				GetPendingCount();
+	size_t				GetWorkerCount() const	{	return mWorkers.GetSize();	}
+
+private:
+	std::shared_ptr<TJob>	PopUnstartedJob();
+	void				OnJobFinished(std::shared_ptr<TJob> Job);
+	void				OutputJob(TJob& Job);
+	bool				HasUnstartedJob();
+
+private:
+	size_t				mMaxPendingJobs;
+	std::mutex			mJobsLock;
+	std::condition_variable	mJobsChanged;
+	std::deque<std::shared_ptr<TJob>>	mJobs;		//	in push order, front is output next
+	std::mutex			mOutputLock;
+	Array<std::shared_ptr<TOrderedJobWorker>>	mWorkers;
+};
+
+
+class Gif::TOrderedJobWorker : public SoyWorkerThread
+{
+public:
+	TOrderedJobWorker(const std::string& Name,TOrderedJobPool& Pool) :
+		SoyWorkerThread	( Name, SoyWorkerWaitMode::Wake ),
+		mPool			( Pool )
+	{
+		Start();
+	}
+
+	~TOrderedJobWorker()
+	{
+		SoyThread::Stop(false);
+		WaitToFinish();
+	}
+
+	virtual bool		CanSleep() override
+	{
+		return !mPool.HasUnstartedJob();
+	}
+
+	virtual bool		Iteration() override
+	{
+		auto Job = mPool.PopUnstartedJob();
+		if ( !Job )
+			return true;
+
+		Job->Run();
+		mPool.OnJobFinished( Job );
+		return true;
+	}
+
+private:
+	TOrderedJobPool&	mPool;
+};
+
+
+class Gif::TTaskPool
+{
+	friend class TTaskWorker;
+public:
+	//	tasks that are waited on together
+	class TGroup
+	{
+	public:
+		TGroup() :
+			mPendingCount	( 0 )
+		{
+		}
+
+		size_t				mPendingCount;	//	guarded by the pool's lock
+		std::string			mError;			//	first task exception
+	};
+
+private:
+	class TTask
+	{
+	public:
+		std::function<void()>	mRun;
+		TGroup*					mGroup;
+	};
+
+public:
+	//	WorkerCount of 0 runs tasks immediately on the pushing thread
+	TTaskPool(const std::string& Name,size_t WorkerCount);
+	~TTaskPool();
+
+	void				Push(TGroup& Group,std::function<void()> Task);
+	//	runs queued tasks (anyone's) until Group's have all finished, so tasks can push & wait on tasks of their
+	//	own without running out of threads. Throws if a task did
+	void				Wait(TGroup& Group);
+	size_t				GetWorkerCount() const	{	return mWorkers.GetSize();	}
+
+private:
+	//	waiters take the newest task (most likely their own, and smallest), idle workers take the oldest (biggest)
+	bool				RunTask(bool Newest);
+	bool				HasTask();
+
+private:
+	std::mutex			mTasksLock;
+	std::condition_variable	mTasksChanged;
+	std::deque<TTask>	mTasks;
+	Array<std::shared_ptr<TTaskWorker>>	mWorkers;
+};
+
+
+class Gif::TTaskWorker : public SoyWorkerThread
+{
+public:
+	TTaskWorker(const std::string& Name,TTaskPool& Pool) :
+		SoyWorkerThread	( Name, SoyWorkerWaitMode::Wake ),
+		mPool			( Pool )
+	{
+		Start();
+	}
+
+	~TTaskWorker()
+	{
+		SoyThread::Stop(false);
+		WaitToFinish();
+	}
+
+	virtual bool		CanSleep() override
+	{
+		return !mPool.HasTask();
+	}
+
+	virtual bool		Iteration() override
+	{
+		mPool.RunTask(false);
+		return true;
+	}
+
+private:
+	TTaskPool&			mPool;
+};
+
+
+
+inline Gif::TOrderedJobPool::TOrderedJobPool(const std::string& Name,size_t WorkerCount,size_t MaxPendingJobs) :
+	mMaxPendingJobs	( std::max<size_t>( 1, MaxPendingJobs ) )
+{
+	for ( size_t i=0;	i<WorkerCount;	i++ )
+	{
+		std::stringstream WorkerName;
+		WorkerName << Name << " " << i;
+		mWorkers.PushBack( std::make_shared<TOrderedJobWorker>( WorkerName.str(), *this ) );
+	}
+}
+
+inline Gif::TOrderedJobPool::~TOrderedJobPool()
+{
+	//	workers stop after their current job, anything else is dropped
+	mWorkers.Clear();
+
+	std::lock_guard<std::mutex> Lock( mJobsLock );
+	mJobs.clear();
+}
+
+inline void Gif::TOrderedJobPool::TJob::Run()
+{
+	//	only this job's worker touches it until it's marked finished
+	try
+	{
+		mRun();
+	}
+	catch(std::exception& e)
+	{
+		std::Debug << "Gif job exception; " << e.what() << std::endl;
+		mRunFailed = true;
+		mError = e.what();
+	}
+}
+
+inline void Gif::TOrderedJobPool::Push(std::function<void()> Run,std::function<void()> Output,std::function<void(const std::string&)> Failed)
+{
+	std::shared_ptr<TJob> Job( new TJob );
+	Job->mRun = Run;
+	Job->mOutput = Output;
+	Job->mFailed = Failed;
+
+	//	no workers, do it now
+	if ( mWorkers.IsEmpty() )
+	{
+		Job->Run();
+		std::lock_guard<std::mutex> Lock( mOutputLock );
+		OutputJob( *Job );
+		return;
+	}
+
+	{
+		std::unique_lock<std::mutex> Lock( mJobsLock );
+		mJobsChanged.wait( Lock, [this]{	return mJobs.size() < mMaxPendingJobs;	} );
+		mJobs.push_back( Job );
+	}
+
+	for ( size_t w=0;	w<mWorkers.GetSize();	w++ )
+		mWorkers[w]->Wake();
+}
+
+inline void Gif::TOrderedJobPool::Flush()
+{
+	std::unique_lock<std::mutex> Lock( mJobsLock );
+	mJobsChanged.wait( Lock, [this]{	return mJobs.empty();	} );
+}
+
+inline size_t Gif::TOrderedJobPool::GetPendingCount()
+{
+	std::lock_guard<std::mutex> Lock( mJobsLock );
+	return mJobs.size();
+}
+
+inline bool Gif::TOrderedJobPool::HasUnstartedJob()
+{
+	std::lock_guard<std::mutex> Lock( mJobsLock );
+	for ( auto& Job : mJobs )
+	{
+		if ( !Job->mStarted )
+			return true;
+	}
+	return false;
+}
+
+inline std::shared_ptr<Gif::TOrderedJobPool::TJob> Gif::TOrderedJobPool::PopUnstartedJob()
+{
+	std::lock_guard<std::mutex> Lock( mJobsLock );
+	for ( auto& Job : mJobs )
+	{
+		if ( Job->mStarted )
+			continue;
+		Job->mStarted = true;
+		return Job;
+	}
+	return nullptr;
+}
+
+inline void Gif::TOrderedJobPool::OnJobFinished(std::shared_ptr<TJob> Job)
+{
+	//	whoever holds the output lock outputs every finished job at the front, so order is kept
+	//	even if another worker finishes at the same time
+	{
+		std::lock_guard<std::mutex> Lock( mJobsLock );
+		Job->mFinished = true;
+	}
+
+	std::lock_guard<std::mutex> OutputLock( mOutputLock );
+	while ( true )
+	{
+		std::shared_ptr<TJob> FrontJob;
+		{
+			std::lock_guard<std::mutex> Lock( mJobsLock );
+			if ( mJobs.empty() || !mJobs.front()->mFinished )
+				break;
+			FrontJob = mJobs.front();
+		}
+
+		OutputJob( *FrontJob );
+
+		{
+			std::lock_guard<std::mutex> Lock( mJobsLock );
+			mJobs.pop_front();
+		}
+		mJobsChanged.notify_all();
+	}
+}
+
+
+inline void Gif::TOrderedJobPool::OutputJob(TJob& Job)
+{
+	//	a failed job's output would be half made, so it never goes out
+	try
+	{
+		if ( !Job.mRunFailed )
+			Job.mOutput();
+		else if ( Job.mFailed )
+			Job.mFailed( Job.mError );
+	}
+	catch(std::exception& e)
+	{
+		std::Debug << "Gif job output exception; " << e.what() << std::endl;
+	}
+}
+
+
+inline Gif::TTaskPool::TTaskPool(const std::string& Name,size_t WorkerCount)
+{
+	for ( size_t i=0;	i<WorkerCount;	i++ )
+	{
+		std::stringstream WorkerName;
+		WorkerName << Name << " " << i;
+		mWorkers.PushBack( std::make_shared<TTaskWorker>( WorkerName.str(), *this ) );
+	}
+}
+
+inline Gif::TTaskPool::~TTaskPool()
+{
+	//	anyone still waiting owns tasks that are still queued, so this should only happen once they're done
+	mWorkers.Clear();
+}
+
+inline void Gif::TTaskPool::Push(TGroup& Group,std::function<void()> Task)
+{
+	{
+		std::lock_guard<std::mutex> Lock( mTasksLock );
+		Group.mPendingCount++;
+		TTask NewTask;
+		NewTask.mRun = Task;
+		NewTask.mGroup = &Group;
+		mTasks.push_back( NewTask );
+	}
+
+	//	no workers, do it now
+	if ( mWorkers.IsEmpty() )
+	{
+		RunTask(true);
+		return;
+	}
+
+	mTasksChanged.notify_all();
+	for ( size_t w=0;	w<mWorkers.GetSize();	w++ )
+		mWorkers[w]->Wake();
+}
+
+inline void Gif::TTaskPool::Wait(TGroup& Group)
+{
+	while ( true )
+	{
+		{
+			std::lock_guard<std::mutex> Lock( mTasksLock );
+			if ( Group.mPendingCount == 0 )
+				break;
+		}
+
+		if ( RunTask(true) )
+			continue;
+
+		//	ours are running elsewhere
+		std::unique_lock<std::mutex> Lock( mTasksLock );
+		mTasksChanged.wait( Lock, [&Group,this]{	return Group.mPendingCount == 0 || !mTasks.empty();	} );
+	}
+
+	if ( !Group.mError.empty() )
+		throw Soy::AssertException( Group.mError );
+}
+
+inline bool Gif::TTaskPool::HasTask()
+{
+	std::lock_guard<std::mutex> Lock( mTasksLock );
+	return !mTasks.empty();
+}
+
+inline bool Gif::TTaskPool::RunTask(bool Newest)
+{
+	TTask Task;
+	{
+		std::lock_guard<std::mutex> Lock( mTasksLock );
+		if ( mTasks.empty() )
+			return false;
+		if ( Newest )
+		{
+			Task = mTasks.back();
+			mTasks.pop_back();
+		}
+		else
+		{
+			Task = mTasks.front();
+			mTasks.pop_front();
+		}
+	}
+
+	std::string Error;
+	try
+	{
+		Task.mRun();
+	}
+	catch(std::exception& e)
+	{
+		Error = e.what();
+	}
+
+	{
+		std::lock_guard<std::mutex> Lock( mTasksLock );
+		if ( Task.mGroup->mError.empty() )
+			Task.mGroup->mError = Error;
+		Task.mGroup->mPendingCount--;
+	}
+	mTasksChanged.notify_all();
+	return true;
+}
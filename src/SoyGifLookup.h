@@ -0,0 +1,197 @@
+#pragma once
+
+//	rgb -> palette index lookup tables for the cpu indexer.
+//	The palette is quantised into a 3D table of cells, each cell holds the nearest palette index to its centre,
+//	so indexing a pixel is one table load instead of a search over the palette.
+//	Tables are cached by palette so frames that keep the same palette (static scenes) don't rebuild.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include "SoyGifSimd.h"
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+
+namespace Gif
+{
+	class TIndexLookupTable;
+	class TIndexLookupCache;
+
+	uint64				GetPaletteHash(const TIndexPalette& Palette);
+}
+
+
+class Gif::TIndexLookupTable
+{
+public:
+	static const size_t	MinBits = 4;
+	static const size_t	MaxBits = 7;
+
+public:
+	TIndexLookupTable(size_t Bits,const TIndexPalette& Palette,uint64 PaletteHash) :
+		mBits			( Bits ),
+		mFirstIndex		( Palette.mFirstIndex ),
+		mPaletteHash	( PaletteHash )
+	{
+		Soy::Assert( mBits >= MinBits && mBits <= MaxBits, "TIndexLookupTable bits out of range" );
+		for ( size_t i=0;	i<Palette.mSize;	i++ )
+			mPaletteRgb.PushBack( GetRgb( Palette, i ) );
+	}
+
+	//	fill every cell with the kernel, a row of cells along blue at a time
+	void			Build(const TIndexPalette& Palette,TIndexRowFunc IndexRow)
+	{
+		auto CellsPerAxis = GetCellsPerAxis();
+		mTable.SetSize( CellsPerAxis * CellsPerAxis * CellsPerAxis );
+		auto* Table = mTable.GetArray();
+
+		//	min bits(4) is 16 cells, so rows are always a multiple of the kernel width
+		auto Shift = 8 - mBits;
+		auto HalfCell = (1<<Shift) / 2;
+		GIF_ALIGN(32) uint16 Red[1<<MaxBits];
+		GIF_ALIGN(32) uint16 Green[1<<MaxBits];
+		GIF_ALIGN(32) uint16 Blue[1<<MaxBits];
+		for ( size_t b=0;	b<CellsPerAxis;	b++ )
+			Blue[b] = size_cast<uint16>( (b<<Shift) + HalfCell );
+
+		for ( size_t r=0;	r<CellsPerAxis;	r++ )
+		{
+			for ( size_t g=0;	g<CellsPerAxis;	g++ )
+			{
+				std::fill( Red, Red+CellsPerAxis, size_cast<uint16>( (r<<Shift) + HalfCell ) );
+				std::fill( Green, Green+CellsPerAxis, size_cast<uint16>( (g<<Shift) + HalfCell ) );
+				auto* Row = &Table[ GetCell( r, g, 0 ) ];
+				IndexRow( Palette, Red, Green, Blue, Row, CellsPerAxis );
+			}
+		}
+	}
+
+	inline uint8	GetIndex(uint8 r,uint8 g,uint8 b) const
+	{
+		auto Shift = 8 - mBits;
+		return mTable[ GetCell( r>>Shift, g>>Shift, b>>Shift ) ];
+	}
+
+	//	the hash only narrows it down, different palettes can share one
+	bool			IsPalette(const TIndexPalette& Palette,uint64 PaletteHash) const
+	{
+		if ( mPaletteHash != PaletteHash || mPaletteRgb.GetSize() != Palette.mSize || mFirstIndex != Palette.mFirstIndex )
+			return false;
+		for ( size_t i=mFirstIndex;	i<Palette.mSize;	i++ )
+		{
+			if ( mPaletteRgb[i] != GetRgb( Palette, i ) )
+				return false;
+		}
+		return true;
+	}
+
+	static inline uint32	GetRgb(const TIndexPalette& Palette,size_t Index)
+	{
+		return (Palette.mRed[Index] << 16) | (Palette.mGreen[Index] << 8) | Palette.mBlue[Index];
+	}
+
+	size_t			GetCellsPerAxis() const	{	return 1 << mBits;	}
+	size_t			GetCellCount() const	{	return GetCellsPerAxis() * GetCellsPerAxis() * GetCellsPerAxis();	}
+
+private:
+	inline size_t	GetCell(size_t r,size_t g,size_t b) const
+	{
+		return (r << (mBits*2)) | (g << mBits) | b;
+	}
+
+public:
+	size_t			mBits;
+	size_t			mFirstIndex;
+	BufferArray<uint32,256>	mPaletteRgb;	//	what the table was built from
+	uint64			mPaletteHash;
+	Array<uint8>	mTable;
+};
+
+
+//	small most-recently-used cache of tables. Usually there's only one palette in use, but
+//	a couple of spare entries covers scenes flicking between palettes
+class Gif::TIndexLookupCache
+{
+public:
+	TIndexLookupCache(size_t Bits,size_t MaxTables=4) :
+		mHitCount	( 0 ),
+		mBuildCount	( 0 ),
+		mBits		( Bits ),
+		mMaxTables	( MaxTables )
+	{
+		//	0 = disabled
+		size_t MinBits = TIndexLookupTable::MinBits;
+		size_t MaxBits = TIndexLookupTable::MaxBits;
+		if ( mBits != 0 )
+			mBits = std::min( std::max( mBits, MinBits ), MaxBits );
+	}
+
+	bool			IsEnabled() const	{	return mBits != 0;	}
+
+	//	returns null if not cached and AllowBuild is false
+	std::shared_ptr<TIndexLookupTable>	GetTable(const TIndexPalette& Palette,TIndexRowFunc IndexRow,bool AllowBuild)
+	{
+		if ( !IsEnabled() )
+			return nullptr;
+
+		auto Hash = GetPaletteHash( Palette );
+		{
+			std::lock_guard<std::mutex> Lock( mTablesLock );
+			for ( size_t i=0;	i<mTables.GetSize();	i++ )
+			{
+				if ( !mTables[i]->IsPalette( Palette, Hash ) )
+					continue;
+
+				//	move to back (most recent)
+				auto Table = mTables.PopAt(i);
+				mTables.PushBack( Table );
+				mHitCount++;
+				return Table;
+			}
+		}
+
+		if ( !AllowBuild )
+			return nullptr;
+
+		//	build outside the lock
+		std::shared_ptr<TIndexLookupTable> Table( new TIndexLookupTable( mBits, Palette, Hash ) );
+		Table->Build( Palette, IndexRow );
+		mBuildCount++;
+
+		std::lock_guard<std::mutex> Lock( mTablesLock );
+		while ( mTables.GetSize() >= mMaxTables )
+			mTables.PopAt(0);
+		mTables.PushBack( Table );
+		return Table;
+	}
+
+	size_t			GetCellCount() const	{	return IsEnabled() ? (1<<mBits)*(1<<mBits)*(1<<mBits) : 0;	}
+
+public:
+	std::atomic<size_t>	mHitCount;
+	std::atomic<size_t>	mBuildCount;
+
+private:
+	size_t				mBits;
+	size_t				mMaxTables;
+	std::mutex			mTablesLock;
+	Array<std::shared_ptr<TIndexLookupTable>>	mTables;
+};
+
+
+//	FNV-1a over the entries the kernel can match (and where matching starts)
+inline uint64 Gif::GetPaletteHash(const TIndexPalette& Palette)
+{
+	uint64 Hash = 14695981039346656037ull;
+	auto Mix = [&Hash](uint64 Value)
+	{
+		Hash ^= Value;
+		Hash *= 1099511628211ull;
+	};
+
+	Mix( Palette.mSize );
+	Mix( Palette.mFirstIndex );
+	for ( size_t i=Palette.mFirstIndex;	i<Palette.mSize;	i++ )
+		Mix( TIndexLookupTable::GetRgb( Palette, i ) );
+	return Hash;
+}
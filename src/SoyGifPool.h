@@ -0,0 +1,173 @@
+#pragma once
+
+//	recycles the pixel buffers the gif encoder churns through every frame (readback, crops, palettes, indexes).
+//	Buffers come out as shared pointers which return themselves to the pool when the last user (often the
+//	muxer, after lzw) lets go, so they can cross threads like any other pixels.
+//	Buffers are matched on format & capacity rather than exact size, as the changed rect is a different
+//	size every frame, and shrinking pixels keeps their allocation.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include <SoyTypes.h>
+#include <SoyPixels.h>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+
+namespace Gif
+{
+	class TPixelsPool;
+}
+
+
+class Gif::TPixelsPool : public std::enable_shared_from_this<TPixelsPool>
+{
+private:
+	class TFreePixels
+	{
+	public:
+		TFreePixels() :
+			mPixels		( nullptr ),
+			mCapacity	( 0 )
+		{
+		}
+		TFreePixels(SoyPixels* Pixels,size_t Capacity) :
+			mPixels		( Pixels ),
+			mCapacity	( Capacity )
+		{
+		}
+
+		SoyPixels*		mPixels;
+		size_t			mCapacity;	//	biggest the pixels have been, bytes
+	};
+
+public:
+	//	must be made with make_shared/shared_ptr so buffers can find their way back
+	TPixelsPool(size_t MaxFreeBuffers=16) :
+		mHitCount		( 0 ),
+		mMissCount		( 0 ),
+		mMaxFreeBuffers	( MaxFreeBuffers )
+	{
+	}
+
+	~TPixelsPool()
+	{
+		std::lock_guard<std::mutex> Lock( mFreeLock );
+		for ( size_t i=0;	i<mFree.GetSize();	i++ )
+			delete mFree[i].mPixels;
+		mFree.Clear();
+	}
+
+	//	contents are whatever was there before
+	std::shared_ptr<SoyPixelsImpl>	Alloc(const SoyPixelsMeta& Meta)
+	{
+		auto DataSize = Meta.GetDataSize();
+		auto Free = PopFree( Meta );
+		if ( Free.mPixels && Free.mCapacity >= DataSize )
+		{
+			mHitCount++;
+		}
+		else
+		{
+			mMissCount++;
+			if ( !Free.mPixels )
+				Free.mPixels = new SoyPixels;
+		}
+
+		Free.mPixels->Init( Meta.GetWidth(), Meta.GetHeight(), Meta.GetFormat() );
+		auto Capacity = std::max( Free.mCapacity, DataSize );
+
+		std::weak_ptr<TPixelsPool> WeakPool = shared_from_this();
+		auto Release = [WeakPool,Capacity](SoyPixelsImpl* Pixels)
+		{
+			auto Pool = WeakPool.lock();
+			if ( Pool )
+				Pool->Release( static_cast<SoyPixels*>( Pixels ), Capacity );
+			else
+				delete Pixels;
+		};
+		return std::shared_ptr<SoyPixelsImpl>( Free.mPixels, Release );
+	}
+
+	size_t			GetFreeCount()
+	{
+		std::lock_guard<std::mutex> Lock( mFreeLock );
+		return mFree.GetSize();
+	}
+
+	//	0-100
+	size_t			GetHitPercent() const
+	{
+		size_t Hits = mHitCount;
+		size_t Total = Hits + mMissCount;
+		return Total == 0 ? 0 : (Hits * 100) / Total;
+	}
+
+private:
+	//	prefer the same meta, then the smallest that fits, then the biggest of the same format (which will grow)
+	TFreePixels		PopFree(const SoyPixelsMeta& Meta)
+	{
+		auto DataSize = Meta.GetDataSize();
+		std::lock_guard<std::mutex> Lock( mFreeLock );
+
+		int Best = -1;
+		bool BestFits = false;
+		for ( int i=0;	i<size_cast<int>(mFree.GetSize());	i++ )
+		{
+			auto& Free = mFree[i];
+			if ( Free.mPixels->GetFormat() != Meta.GetFormat() )
+				continue;
+
+			if ( Free.mPixels->GetMeta() == Meta )
+			{
+				Best = i;
+				break;
+			}
+
+			bool Fits = Free.mCapacity >= DataSize;
+			if ( Best == -1 )
+			{
+				Best = i;
+				BestFits = Fits;
+				continue;
+			}
+
+			auto& BestFree = mFree[Best];
+			if ( Fits && ( !BestFits || Free.mCapacity < BestFree.mCapacity ) )
+			{
+				Best = i;
+				BestFits = true;
+			}
+			else if ( !Fits && !BestFits && Free.mCapacity > BestFree.mCapacity )
+			{
+				Best = i;
+			}
+		}
+
+		if ( Best == -1 )
+			return TFreePixels();
+		return mFree.PopAt( Best );
+	}
+
+	void			Release(SoyPixels* Pixels,size_t Capacity)
+	{
+		{
+			std::lock_guard<std::mutex> Lock( mFreeLock );
+			if ( mFree.GetSize() < mMaxFreeBuffers )
+			{
+				mFree.PushBack( TFreePixels( Pixels, Capacity ) );
+				return;
+			}
+		}
+		delete Pixels;
+	}
+
+public:
+	std::atomic<size_t>	mHitCount;
+	std::atomic<size_t>	mMissCount;
+
+private:
+	size_t				mMaxFreeBuffers;
+	std::mutex			mFreeLock;
+	Array<TFreePixels>	mFree;
+};
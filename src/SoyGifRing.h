@@ -0,0 +1,78 @@
+#pragma once
+
+//	fixed size queue for one producer & one consumer thread, neither of which take a lock. Anything that might
+//	push from more than one thread needs to serialise its pushes itself.
+//	Pop is the consumer's side too, so anything that pops from the producer side (eg. the encoder evicting the
+//	oldest frame for TQueuePolicy::DropOldest) has to serialise those pops with the consumer's. The encoder does
+//	that with the same lock its pushes take, so in that mode this is really a locked queue.
+//	sizes read from either side are a snapshot, the other thread may have moved on by the time it's used.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include <SoyTypes.h>
+#include <atomic>
+
+
+namespace Gif
+{
+	template<typename TYPE>
+	class TSpscRing;
+}
+
+
+template<typename TYPE>
+class Gif::TSpscRing
+{
+public:
+	TSpscRing(size_t Capacity) :
+		mRead	( 0 ),
+		mWrite	( 0 )
+	{
+		//	one slot is always empty to tell full from empty
+		mSlots.SetSize( std::max<size_t>( 1, Capacity ) + 1 );
+	}
+
+	//	producer. false if full
+	bool		Push(const TYPE& Item)
+	{
+		auto Write = mWrite.load( std::memory_order_relaxed );
+		auto Next = GetNext( Write );
+		if ( Next == mRead.load( std::memory_order_acquire ) )
+			return false;
+
+		mSlots[Write] = Item;
+		mWrite.store( Next, std::memory_order_release );
+		return true;
+	}
+
+	//	consumer (or serialised with it, see above). false if empty
+	bool		Pop(TYPE& Item)
+	{
+		auto Read = mRead.load( std::memory_order_relaxed );
+		if ( Read == mWrite.load( std::memory_order_acquire ) )
+			return false;
+
+		//	don't hold on to the item in the slot
+		Item = mSlots[Read];
+		mSlots[Read] = TYPE();
+		mRead.store( GetNext( Read ), std::memory_order_release );
+		return true;
+	}
+
+	size_t		GetSize() const
+	{
+		auto Read = mRead.load( std::memory_order_acquire );
+		auto Write = mWrite.load( std::memory_order_acquire );
+		return ( Write + mSlots.GetSize() - Read ) % mSlots.GetSize();
+	}
+
+	bool		IsEmpty() const		{	return GetSize() == 0;	}
+	size_t		GetCapacity() const	{	return mSlots.GetSize() - 1;	}
+
+private:
+	size_t		GetNext(size_t Index) const	{	return ( Index + 1 ) % mSlots.GetSize();	}
+
+private:
+	Array<TYPE>			mSlots;
+	std::atomic<size_t>	mRead;		//	only moved by the consumer
+	std::atomic<size_t>	mWrite;		//	only moved by the producer
+};
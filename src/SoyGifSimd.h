@@ -0,0 +1,723 @@
+#pragma once
+
+//	cpu kernels for the gif encoder.
+//	Each kernel has a scalar version and SSE4/AVX2/NEON versions. x86 picks at runtime (we don't build with -mavx2)
+//	arm has neon at compile time.
+//	like gif.h, this is only included by SoyGif.cpp
+
+#include <SoyTypes.h>
+#include <SoyPixels.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GIF_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define GIF_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//	gcc & clang won't emit sse4/avx2 instructions unless the function is marked (or the whole project built with -mavx2)
+//	msvc will emit anything
+#if defined(GIF_SIMD_X86) && !defined(_MSC_VER)
+#define GIF_TARGET_SSE4		__attribute__((target("sse4.1")))
+#define GIF_TARGET_AVX2		__attribute__((target("avx2")))
+#else
+#define GIF_TARGET_SSE4
+#define GIF_TARGET_AVX2
+#endif
+
+#if defined(_MSC_VER)
+#define GIF_ALIGN(n)		__declspec(align(n))
+#else
+#define GIF_ALIGN(n)		__attribute__((aligned(n)))
+#endif
+
+
+namespace Gif
+{
+	namespace TSimdLevel
+	{
+		enum Type
+		{
+			Scalar,
+			Sse4,
+			Avx2,
+			Neon,
+		};
+
+		inline const char*	ToString(Type Level)
+		{
+			switch ( Level )
+			{
+				case Scalar:	return "Scalar";
+				case Sse4:		return "Sse4";
+				case Avx2:		return "Avx2";
+				case Neon:		return "Neon";
+			}
+			return "Unknown";
+		}
+	}
+
+	TSimdLevel::Type	GetSimdLevel();
+
+	class TIndexPalette;
+
+	//	widest kernel (avx2) does 16 pixels at a time, row scratch buffers are padded to this
+	static const size_t	SimdPixelAlign = 16;
+
+	typedef void(*TIndexRowFunc)(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count);
+	TIndexRowFunc		GetIndexRowFunc(TSimdLevel::Type Level);
+
+	void				IndexRow_Scalar(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count);
+#if defined(GIF_SIMD_X86)
+	void				IndexRow_Sse4(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count);
+	void				IndexRow_Avx2(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count);
+#endif
+#if defined(GIF_SIMD_NEON)
+	void				IndexRow_Neon(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count);
+#endif
+
+	//	frame differencing on rows of rgba. Pixels that match the previous frame (sum of abs rgb differences <= MaxDiff)
+	//	get alpha 0, changed pixels which are still opaque are counted & bounded.
+	//	Exact (MaxDiff=0) kernels are separate as they're just a compare
+	class TMaskRowResult;
+	typedef void(*TMaskRowFunc)(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result);
+	TMaskRowFunc		GetMaskRowFunc(TSimdLevel::Type Level,bool Exact);
+
+	template<bool EXACT> void	MaskRange_Scalar(const uint8* PrevRgba,uint8* Rgba,size_t Begin,size_t End,int MaxDiff,TMaskRowResult& Result);
+	template<bool EXACT> void	MaskRow_Scalar(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result);
+#if defined(GIF_SIMD_X86)
+	//	attributes have to be on template declarations too
+	template<bool EXACT> GIF_TARGET_SSE4 void	MaskRow_Sse4(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result);
+	template<bool EXACT> GIF_TARGET_AVX2 void	MaskRow_Avx2(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result);
+#endif
+#if defined(GIF_SIMD_NEON)
+	template<bool EXACT> void	MaskRow_Neon(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result);
+#endif
+
+	//	2x2 box downscale of rgba rows; each output pixel is the rounded average of its two (rounded) column averages,
+	//	which is what the simd byte averages do, so every kernel gives the same result. Row0 & Row1 have OutputCount*2 pixels
+	typedef void(*THalveRowFunc)(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount);
+	THalveRowFunc		GetHalveRowFunc(TSimdLevel::Type Level);
+
+	void				HalveRow_Scalar(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount);
+#if defined(GIF_SIMD_X86)
+	GIF_TARGET_SSE4 void	HalveRow_Sse4(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount);
+	GIF_TARGET_AVX2 void	HalveRow_Avx2(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount);
+#endif
+#if defined(GIF_SIMD_NEON)
+	void				HalveRow_Neon(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount);
+#endif
+
+	//	for kernel lane masks, Bits must be non-zero for lowest/highest
+	inline size_t		GetBitCount(uint32 Bits)
+	{
+		Bits = Bits - ((Bits >> 1) & 0x55555555);
+		Bits = (Bits & 0x33333333) + ((Bits >> 2) & 0x33333333);
+		return ( ((Bits + (Bits >> 4)) & 0x0f0f0f0f) * 0x01010101 ) >> 24;
+	}
+
+	inline size_t		GetLowestBit(uint32 Bits)
+	{
+#if defined(_MSC_VER)
+		unsigned long Index;
+		_BitScanForward( &Index, Bits );
+		return Index;
+#else
+		return __builtin_ctz( Bits );
+#endif
+	}
+
+	inline size_t		GetHighestBit(uint32 Bits)
+	{
+#if defined(_MSC_VER)
+		unsigned long Index;
+		_BitScanReverse( &Index, Bits );
+		return Index;
+#else
+		return 31 - __builtin_clz( Bits );
+#endif
+	}
+}
+
+
+//	structure-of-arrays copy of a palette for the indexing kernels.
+//	entries before mFirstIndex (the transparent index) are never matched
+class Gif::TIndexPalette
+{
+public:
+	TIndexPalette() :
+		mSize		( 0 ),
+		mFirstIndex	( 0 )
+	{
+	}
+
+	void		Init(const SoyPixelsImpl& Palette,size_t TransparentIndex)
+	{
+		Soy::Assert( Palette.GetChannels() >= 3, "TIndexPalette expects RGB(A) palette" );
+		mSize = std::min<size_t>( Palette.GetWidth(), 256 );
+
+		//	gr: transparent is always 0 at the moment, if that changes, this needs to skip it rather than start after it
+		Soy::Assert( TransparentIndex == 0, "TIndexPalette currently expects transparent index to be 0" );
+		mFirstIndex = std::min<size_t>( TransparentIndex + 1, mSize );
+
+		auto Channels = Palette.GetChannels();
+		auto* PaletteRgb = Palette.GetPixelsArray().GetArray();
+		for ( size_t i=0;	i<mSize;	i++ )
+		{
+			mRed[i] = PaletteRgb[i*Channels+0];
+			mGreen[i] = PaletteRgb[i*Channels+1];
+			mBlue[i] = PaletteRgb[i*Channels+2];
+		}
+	}
+
+	bool		IsEmpty() const		{	return mFirstIndex >= mSize;	}
+
+public:
+	size_t				mSize;
+	size_t				mFirstIndex;
+	GIF_ALIGN(32) int16_t	mRed[256];
+	GIF_ALIGN(32) int16_t	mGreen[256];
+	GIF_ALIGN(32) int16_t	mBlue[256];
+};
+
+
+
+//	x is relative to the row
+class Gif::TMaskRowResult
+{
+public:
+	TMaskRowResult() :
+		mChangedCount	( 0 ),
+		mMinX			( 0 ),
+		mMaxX			( 0 ),
+		mMasked			( false )
+	{
+	}
+
+	//	kernels go left to right, so the first changed pixel is the min and the latest is the max
+	inline void	AddChanged(size_t FirstX,size_t LastX,size_t Count)
+	{
+		if ( mChangedCount == 0 )
+			mMinX = FirstX;
+		mMaxX = LastX;
+		mChangedCount += Count;
+	}
+
+public:
+	size_t		mChangedCount;
+	size_t		mMinX;
+	size_t		mMaxX;
+	bool		mMasked;		//	at least one pixel matched & was made transparent
+};
+
+
+
+Gif::TSimdLevel::Type Gif::GetSimdLevel()
+{
+	//	for debugging/comparing kernels
+	static bool ForceScalar = false;
+	if ( ForceScalar )
+		return TSimdLevel::Scalar;
+
+#if defined(GIF_SIMD_NEON)
+	return TSimdLevel::Neon;
+#elif defined(GIF_SIMD_X86)
+	//	called from the encoder, palettise, lzw and task threads, so detect once under the static init guard
+	static const TSimdLevel::Type Level = []
+	{
+#if defined(_MSC_VER)
+		int Info[4];
+		__cpuid( Info, 0 );
+		auto MaxLeaf = Info[0];
+
+		__cpuid( Info, 1 );
+		bool HasSse4 = (Info[2] & (1<<19)) != 0;
+		bool HasOsAvx = (Info[2] & (1<<27)) && (Info[2] & (1<<28)) && ((_xgetbv(0) & 0x6) == 0x6);
+		bool HasAvx2 = false;
+		if ( HasOsAvx && MaxLeaf >= 7 )
+		{
+			__cpuidex( Info, 7, 0 );
+			HasAvx2 = (Info[1] & (1<<5)) != 0;
+		}
+#else
+		__builtin_cpu_init();
+		bool HasSse4 = __builtin_cpu_supports("sse4.1");
+		bool HasAvx2 = __builtin_cpu_supports("avx2");
+#endif
+
+		return HasAvx2 ? TSimdLevel::Avx2 : ( HasSse4 ? TSimdLevel::Sse4 : TSimdLevel::Scalar );
+	}();
+	return Level;
+#else
+	return TSimdLevel::Scalar;
+#endif
+}
+
+
+Gif::TIndexRowFunc Gif::GetIndexRowFunc(TSimdLevel::Type Level)
+{
+	switch ( Level )
+	{
+#if defined(GIF_SIMD_X86)
+		case TSimdLevel::Avx2:	return IndexRow_Avx2;
+		case TSimdLevel::Sse4:	return IndexRow_Sse4;
+#endif
+#if defined(GIF_SIMD_NEON)
+		case TSimdLevel::Neon:	return IndexRow_Neon;
+#endif
+		default:
+			return IndexRow_Scalar;
+	}
+}
+
+
+//	nearest by sum of absolute differences (same metric as the GifNearest shaders), first best match wins
+void Gif::IndexRow_Scalar(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count)
+{
+	for ( size_t p=0;	p<Count;	p++ )
+	{
+		int r = Red[p];
+		int g = Green[p];
+		int b = Blue[p];
+		int BestDiff = 0x7fff;
+		size_t BestIndex = Palette.mFirstIndex;
+		for ( size_t i=Palette.mFirstIndex;	i<Palette.mSize;	i++ )
+		{
+			int Diff = abs( r - Palette.mRed[i] ) + abs( g - Palette.mGreen[i] ) + abs( b - Palette.mBlue[i] );
+			if ( Diff >= BestDiff )
+				continue;
+			BestDiff = Diff;
+			BestIndex = i;
+		}
+		Indexes[p] = static_cast<uint8>( BestIndex );
+	}
+}
+
+
+#if defined(GIF_SIMD_X86)
+//	8 pixels per lane-set, loop over the palette
+GIF_TARGET_SSE4 void Gif::IndexRow_Sse4(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count)
+{
+	auto FirstIndex = static_cast<int16_t>( Palette.mFirstIndex );
+	auto Size = static_cast<int16_t>( Palette.mSize );
+
+	size_t p = 0;
+	for ( ;	p+8<=Count;	p+=8 )
+	{
+		__m128i r = _mm_loadu_si128( reinterpret_cast<const __m128i*>(&Red[p]) );
+		__m128i g = _mm_loadu_si128( reinterpret_cast<const __m128i*>(&Green[p]) );
+		__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i*>(&Blue[p]) );
+		__m128i BestDiff = _mm_set1_epi16( 0x7fff );
+		__m128i BestIndex = _mm_set1_epi16( FirstIndex );
+
+		for ( int16_t i=FirstIndex;	i<Size;	i++ )
+		{
+			__m128i dr = _mm_abs_epi16( _mm_sub_epi16( r, _mm_set1_epi16( Palette.mRed[i] ) ) );
+			__m128i dg = _mm_abs_epi16( _mm_sub_epi16( g, _mm_set1_epi16( Palette.mGreen[i] ) ) );
+			__m128i db = _mm_abs_epi16( _mm_sub_epi16( b, _mm_set1_epi16( Palette.mBlue[i] ) ) );
+			__m128i Diff = _mm_add_epi16( _mm_add_epi16( dr, dg ), db );
+			__m128i Better = _mm_cmplt_epi16( Diff, BestDiff );
+			BestDiff = _mm_min_epi16( Diff, BestDiff );
+			BestIndex = _mm_blendv_epi8( BestIndex, _mm_set1_epi16( i ), Better );
+		}
+
+		__m128i Packed = _mm_packus_epi16( BestIndex, BestIndex );
+		_mm_storel_epi64( reinterpret_cast<__m128i*>(&Indexes[p]), Packed );
+	}
+
+	IndexRow_Scalar( Palette, Red+p, Green+p, Blue+p, Indexes+p, Count-p );
+}
+#endif
+
+
+#if defined(GIF_SIMD_X86)
+//	16 pixels per lane-set, loop over the palette
+GIF_TARGET_AVX2 void Gif::IndexRow_Avx2(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count)
+{
+	auto FirstIndex = static_cast<int16_t>( Palette.mFirstIndex );
+	auto Size = static_cast<int16_t>( Palette.mSize );
+
+	size_t p = 0;
+	for ( ;	p+16<=Count;	p+=16 )
+	{
+		__m256i r = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(&Red[p]) );
+		__m256i g = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(&Green[p]) );
+		__m256i b = _mm256_loadu_si256( reinterpret_cast<const __m256i*>(&Blue[p]) );
+		__m256i BestDiff = _mm256_set1_epi16( 0x7fff );
+		__m256i BestIndex = _mm256_set1_epi16( FirstIndex );
+
+		for ( int16_t i=FirstIndex;	i<Size;	i++ )
+		{
+			__m256i dr = _mm256_abs_epi16( _mm256_sub_epi16( r, _mm256_set1_epi16( Palette.mRed[i] ) ) );
+			__m256i dg = _mm256_abs_epi16( _mm256_sub_epi16( g, _mm256_set1_epi16( Palette.mGreen[i] ) ) );
+			__m256i db = _mm256_abs_epi16( _mm256_sub_epi16( b, _mm256_set1_epi16( Palette.mBlue[i] ) ) );
+			__m256i Diff = _mm256_add_epi16( _mm256_add_epi16( dr, dg ), db );
+			__m256i Better = _mm256_cmpgt_epi16( BestDiff, Diff );
+			BestDiff = _mm256_min_epi16( Diff, BestDiff );
+			BestIndex = _mm256_blendv_epi8( BestIndex, _mm256_set1_epi16( i ), Better );
+		}
+
+		//	256 bit packus works per-128 lane, so pack the halves ourselves
+		__m128i Low = _mm256_castsi256_si128( BestIndex );
+		__m128i High = _mm256_extracti128_si256( BestIndex, 1 );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>(&Indexes[p]), _mm_packus_epi16( Low, High ) );
+	}
+
+	if ( p < Count )
+		IndexRow_Sse4( Palette, Red+p, Green+p, Blue+p, Indexes+p, Count-p );
+}
+#endif
+
+
+#if defined(GIF_SIMD_NEON)
+//	8 pixels per lane-set, loop over the palette
+void Gif::IndexRow_Neon(const TIndexPalette& Palette,const uint16* Red,const uint16* Green,const uint16* Blue,uint8* Indexes,size_t Count)
+{
+	auto FirstIndex = static_cast<int16_t>( Palette.mFirstIndex );
+	auto Size = static_cast<int16_t>( Palette.mSize );
+
+	size_t p = 0;
+	for ( ;	p+8<=Count;	p+=8 )
+	{
+		int16x8_t r = vreinterpretq_s16_u16( vld1q_u16( &Red[p] ) );
+		int16x8_t g = vreinterpretq_s16_u16( vld1q_u16( &Green[p] ) );
+		int16x8_t b = vreinterpretq_s16_u16( vld1q_u16( &Blue[p] ) );
+		int16x8_t BestDiff = vdupq_n_s16( 0x7fff );
+		int16x8_t BestIndex = vdupq_n_s16( FirstIndex );
+
+		for ( int16_t i=FirstIndex;	i<Size;	i++ )
+		{
+			int16x8_t dr = vabdq_s16( r, vdupq_n_s16( Palette.mRed[i] ) );
+			int16x8_t dg = vabdq_s16( g, vdupq_n_s16( Palette.mGreen[i] ) );
+			int16x8_t db = vabdq_s16( b, vdupq_n_s16( Palette.mBlue[i] ) );
+			int16x8_t Diff = vaddq_s16( vaddq_s16( dr, dg ), db );
+			uint16x8_t Better = vcltq_s16( Diff, BestDiff );
+			BestDiff = vminq_s16( Diff, BestDiff );
+			BestIndex = vbslq_s16( Better, vdupq_n_s16( i ), BestIndex );
+		}
+
+		vst1_u8( &Indexes[p], vqmovun_s16( BestIndex ) );
+	}
+
+	IndexRow_Scalar( Palette, Red+p, Green+p, Blue+p, Indexes+p, Count-p );
+}
+#endif
+
+
+
+Gif::TMaskRowFunc Gif::GetMaskRowFunc(TSimdLevel::Type Level,bool Exact)
+{
+	switch ( Level )
+	{
+#if defined(GIF_SIMD_X86)
+		case TSimdLevel::Avx2:	return Exact ? MaskRow_Avx2<true> : MaskRow_Avx2<false>;
+		case TSimdLevel::Sse4:	return Exact ? MaskRow_Sse4<true> : MaskRow_Sse4<false>;
+#endif
+#if defined(GIF_SIMD_NEON)
+		case TSimdLevel::Neon:	return Exact ? MaskRow_Neon<true> : MaskRow_Neon<false>;
+#endif
+		default:
+			return Exact ? MaskRow_Scalar<true> : MaskRow_Scalar<false>;
+	}
+}
+
+
+//	also does the tails of the simd kernels
+template<bool EXACT>
+void Gif::MaskRange_Scalar(const uint8* PrevRgba,uint8* Rgba,size_t Begin,size_t End,int MaxDiff,TMaskRowResult& Result)
+{
+	for ( size_t x=Begin;	x<End;	x++ )
+	{
+		auto* Old = &PrevRgba[x*4];
+		auto* New = &Rgba[x*4];
+		bool Changed;
+		if ( EXACT )
+			Changed = ( Old[0] != New[0] ) || ( Old[1] != New[1] ) || ( Old[2] != New[2] );
+		else
+			Changed = ( abs( Old[0] - New[0] ) + abs( Old[1] - New[1] ) + abs( Old[2] - New[2] ) ) > MaxDiff;
+
+		if ( !Changed )
+		{
+			New[3] = 0;
+			Result.mMasked = true;
+			continue;
+		}
+
+		if ( New[3] == 0 )
+			continue;
+		Result.AddChanged( x, x, 1 );
+	}
+}
+
+
+template<bool EXACT>
+void Gif::MaskRow_Scalar(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result)
+{
+	MaskRange_Scalar<EXACT>( PrevRgba, Rgba, 0, Count, MaxDiff, Result );
+}
+
+
+#if defined(GIF_SIMD_X86)
+//	4 pixels at a time. Tolerance sums the abs differences per pixel with two multiply-adds (alpha weighted 0)
+template<bool EXACT>
+GIF_TARGET_SSE4 void Gif::MaskRow_Sse4(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result)
+{
+	const __m128i RgbMask = _mm_set1_epi32( 0x00ffffff );
+	const __m128i AlphaMask = _mm_set1_epi32( static_cast<int>(0xff000000) );
+	const __m128i RgbWeights = _mm_set1_epi32( 0x00010101 );
+	const __m128i One16 = _mm_set1_epi16( 1 );
+	const __m128i Threshold = _mm_set1_epi32( MaxDiff );
+	const __m128i Zero = _mm_setzero_si128();
+	__m128i Masked = Zero;
+
+	size_t p = 0;
+	for ( ;	p+4<=Count;	p+=4 )
+	{
+		auto* pNew = reinterpret_cast<__m128i*>( &Rgba[p*4] );
+		__m128i Old = _mm_loadu_si128( reinterpret_cast<const __m128i*>( &PrevRgba[p*4] ) );
+		__m128i New = _mm_loadu_si128( pNew );
+
+		__m128i Changed;
+		if ( EXACT )
+		{
+			__m128i Same = _mm_cmpeq_epi32( _mm_and_si128( Old, RgbMask ), _mm_and_si128( New, RgbMask ) );
+			Changed = _mm_cmpeq_epi32( Same, Zero );
+		}
+		else
+		{
+			__m128i AbsDiff = _mm_or_si128( _mm_subs_epu8( Old, New ), _mm_subs_epu8( New, Old ) );
+			__m128i Sum = _mm_madd_epi16( _mm_maddubs_epi16( AbsDiff, RgbWeights ), One16 );
+			Changed = _mm_cmpgt_epi32( Sum, Threshold );
+		}
+
+		//	alpha away matches
+		__m128i MatchAlpha = _mm_andnot_si128( Changed, AlphaMask );
+		New = _mm_andnot_si128( MatchAlpha, New );
+		Masked = _mm_or_si128( Masked, MatchAlpha );
+		_mm_storeu_si128( pNew, New );
+
+		__m128i Transparent = _mm_cmpeq_epi32( _mm_and_si128( New, AlphaMask ), Zero );
+		__m128i ChangedOpaque = _mm_andnot_si128( Transparent, Changed );
+		uint32 Bits = _mm_movemask_ps( _mm_castsi128_ps( ChangedOpaque ) );
+		if ( Bits )
+			Result.AddChanged( p + GetLowestBit(Bits), p + GetHighestBit(Bits), GetBitCount(Bits) );
+	}
+
+	if ( !_mm_testz_si128( Masked, Masked ) )
+		Result.mMasked = true;
+
+	MaskRange_Scalar<EXACT>( PrevRgba, Rgba, p, Count, MaxDiff, Result );
+}
+#endif
+
+
+#if defined(GIF_SIMD_X86)
+//	8 pixels at a time, same as sse4
+template<bool EXACT>
+GIF_TARGET_AVX2 void Gif::MaskRow_Avx2(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result)
+{
+	const __m256i RgbMask = _mm256_set1_epi32( 0x00ffffff );
+	const __m256i AlphaMask = _mm256_set1_epi32( static_cast<int>(0xff000000) );
+	const __m256i RgbWeights = _mm256_set1_epi32( 0x00010101 );
+	const __m256i One16 = _mm256_set1_epi16( 1 );
+	const __m256i Threshold = _mm256_set1_epi32( MaxDiff );
+	const __m256i Zero = _mm256_setzero_si256();
+	__m256i Masked = Zero;
+
+	size_t p = 0;
+	for ( ;	p+8<=Count;	p+=8 )
+	{
+		auto* pNew = reinterpret_cast<__m256i*>( &Rgba[p*4] );
+		__m256i Old = _mm256_loadu_si256( reinterpret_cast<const __m256i*>( &PrevRgba[p*4] ) );
+		__m256i New = _mm256_loadu_si256( pNew );
+
+		__m256i Changed;
+		if ( EXACT )
+		{
+			__m256i Same = _mm256_cmpeq_epi32( _mm256_and_si256( Old, RgbMask ), _mm256_and_si256( New, RgbMask ) );
+			Changed = _mm256_cmpeq_epi32( Same, Zero );
+		}
+		else
+		{
+			__m256i AbsDiff = _mm256_or_si256( _mm256_subs_epu8( Old, New ), _mm256_subs_epu8( New, Old ) );
+			__m256i Sum = _mm256_madd_epi16( _mm256_maddubs_epi16( AbsDiff, RgbWeights ), One16 );
+			Changed = _mm256_cmpgt_epi32( Sum, Threshold );
+		}
+
+		__m256i MatchAlpha = _mm256_andnot_si256( Changed, AlphaMask );
+		New = _mm256_andnot_si256( MatchAlpha, New );
+		Masked = _mm256_or_si256( Masked, MatchAlpha );
+		_mm256_storeu_si256( pNew, New );
+
+		__m256i Transparent = _mm256_cmpeq_epi32( _mm256_and_si256( New, AlphaMask ), Zero );
+		__m256i ChangedOpaque = _mm256_andnot_si256( Transparent, Changed );
+		uint32 Bits = _mm256_movemask_ps( _mm256_castsi256_ps( ChangedOpaque ) );
+		if ( Bits )
+			Result.AddChanged( p + GetLowestBit(Bits), p + GetHighestBit(Bits), GetBitCount(Bits) );
+	}
+
+	if ( !_mm256_testz_si256( Masked, Masked ) )
+		Result.mMasked = true;
+
+	MaskRange_Scalar<EXACT>( PrevRgba, Rgba, p, Count, MaxDiff, Result );
+}
+#endif
+
+
+#if defined(GIF_SIMD_NEON)
+//	4 pixels at a time. Tolerance sums the abs differences with pairwise widening adds (alpha masked off)
+template<bool EXACT>
+void Gif::MaskRow_Neon(const uint8* PrevRgba,uint8* Rgba,size_t Count,int MaxDiff,TMaskRowResult& Result)
+{
+	static const uint32 LaneBitValues[4] = { 1, 2, 4, 8 };
+	const uint32x4_t LaneBits = vld1q_u32( LaneBitValues );
+	const uint32x4_t RgbMask = vdupq_n_u32( 0x00ffffff );
+	const uint32x4_t AlphaMask = vdupq_n_u32( 0xff000000 );
+	const uint32x4_t Threshold = vdupq_n_u32( static_cast<uint32>( std::max( MaxDiff, 0 ) ) );
+	const uint32x4_t Zero = vdupq_n_u32( 0 );
+	uint32x4_t Masked = Zero;
+
+	size_t p = 0;
+	for ( ;	p+4<=Count;	p+=4 )
+	{
+		uint32x4_t Old = vandq_u32( vreinterpretq_u32_u8( vld1q_u8( &PrevRgba[p*4] ) ), RgbMask );
+		uint32x4_t New = vreinterpretq_u32_u8( vld1q_u8( &Rgba[p*4] ) );
+		uint32x4_t NewRgb = vandq_u32( New, RgbMask );
+
+		uint32x4_t Changed;
+		if ( EXACT )
+		{
+			Changed = vmvnq_u32( vceqq_u32( Old, NewRgb ) );
+		}
+		else
+		{
+			uint8x16_t AbsDiff = vabdq_u8( vreinterpretq_u8_u32( Old ), vreinterpretq_u8_u32( NewRgb ) );
+			uint32x4_t Sum = vpaddlq_u16( vpaddlq_u8( AbsDiff ) );
+			Changed = ( MaxDiff < 0 ) ? vdupq_n_u32( 0xffffffff ) : vcgtq_u32( Sum, Threshold );
+		}
+
+		uint32x4_t MatchAlpha = vbicq_u32( AlphaMask, Changed );
+		New = vbicq_u32( New, MatchAlpha );
+		Masked = vorrq_u32( Masked, MatchAlpha );
+		vst1q_u8( &Rgba[p*4], vreinterpretq_u8_u32( New ) );
+
+		uint32x4_t Transparent = vceqq_u32( vandq_u32( New, AlphaMask ), Zero );
+		uint32x4_t LaneMask = vandq_u32( vbicq_u32( Changed, Transparent ), LaneBits );
+		uint32 Bits = vgetq_lane_u32( LaneMask, 0 ) | vgetq_lane_u32( LaneMask, 1 ) | vgetq_lane_u32( LaneMask, 2 ) | vgetq_lane_u32( LaneMask, 3 );
+		if ( Bits )
+			Result.AddChanged( p + GetLowestBit(Bits), p + GetHighestBit(Bits), GetBitCount(Bits) );
+	}
+
+	uint32x2_t MaskedHalves = vorr_u32( vget_low_u32( Masked ), vget_high_u32( Masked ) );
+	if ( vget_lane_u32( MaskedHalves, 0 ) | vget_lane_u32( MaskedHalves, 1 ) )
+		Result.mMasked = true;
+
+	MaskRange_Scalar<EXACT>( PrevRgba, Rgba, p, Count, MaxDiff, Result );
+}
+#endif
+
+
+Gif::THalveRowFunc Gif::GetHalveRowFunc(TSimdLevel::Type Level)
+{
+	switch ( Level )
+	{
+#if defined(GIF_SIMD_X86)
+		case TSimdLevel::Avx2:	return HalveRow_Avx2;
+		case TSimdLevel::Sse4:	return HalveRow_Sse4;
+#endif
+#if defined(GIF_SIMD_NEON)
+		case TSimdLevel::Neon:	return HalveRow_Neon;
+#endif
+		default:
+			return HalveRow_Scalar;
+	}
+}
+
+
+void Gif::HalveRow_Scalar(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount)
+{
+	//	same rounding as the simd byte averages
+	auto Average = [](int a,int b)
+	{
+		return ( a + b + 1 ) >> 1;
+	};
+
+	for ( size_t x=0;	x<OutputCount;	x++ )
+	{
+		auto* Left0 = &Row0[x*8];
+		auto* Left1 = &Row1[x*8];
+		auto* Out = &Output[x*4];
+		for ( int c=0;	c<4;	c++ )
+		{
+			auto Left = Average( Left0[c], Left1[c] );
+			auto Right = Average( Left0[c+4], Left1[c+4] );
+			Out[c] = static_cast<uint8>( Average( Left, Right ) );
+		}
+	}
+}
+
+
+#if defined(GIF_SIMD_X86)
+//	4 output pixels at a time. Average the rows, then split even & odd pixels and average those
+GIF_TARGET_SSE4 void Gif::HalveRow_Sse4(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount)
+{
+	size_t p = 0;
+	for ( ;	p+4<=OutputCount;	p+=4 )
+	{
+		auto* In0 = reinterpret_cast<const __m128i*>( &Row0[p*8] );
+		auto* In1 = reinterpret_cast<const __m128i*>( &Row1[p*8] );
+		__m128 a = _mm_castsi128_ps( _mm_avg_epu8( _mm_loadu_si128( In0 ), _mm_loadu_si128( In1 ) ) );
+		__m128 b = _mm_castsi128_ps( _mm_avg_epu8( _mm_loadu_si128( In0+1 ), _mm_loadu_si128( In1+1 ) ) );
+		__m128i Even = _mm_castps_si128( _mm_shuffle_ps( a, b, _MM_SHUFFLE(2,0,2,0) ) );
+		__m128i Odd = _mm_castps_si128( _mm_shuffle_ps( a, b, _MM_SHUFFLE(3,1,3,1) ) );
+		_mm_storeu_si128( reinterpret_cast<__m128i*>( &Output[p*4] ), _mm_avg_epu8( Even, Odd ) );
+	}
+
+	HalveRow_Scalar( Row0+p*8, Row1+p*8, Output+p*4, OutputCount-p );
+}
+
+
+//	8 output pixels at a time. shuffles stay within 128 bit lanes, so the pairs of pixels come out of order
+GIF_TARGET_AVX2 void Gif::HalveRow_Avx2(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount)
+{
+	size_t p = 0;
+	for ( ;	p+8<=OutputCount;	p+=8 )
+	{
+		auto* In0 = reinterpret_cast<const __m256i*>( &Row0[p*8] );
+		auto* In1 = reinterpret_cast<const __m256i*>( &Row1[p*8] );
+		__m256 a = _mm256_castsi256_ps( _mm256_avg_epu8( _mm256_loadu_si256( In0 ), _mm256_loadu_si256( In1 ) ) );
+		__m256 b = _mm256_castsi256_ps( _mm256_avg_epu8( _mm256_loadu_si256( In0+1 ), _mm256_loadu_si256( In1+1 ) ) );
+		__m256i Even = _mm256_castps_si256( _mm256_shuffle_ps( a, b, _MM_SHUFFLE(2,0,2,0) ) );
+		__m256i Odd = _mm256_castps_si256( _mm256_shuffle_ps( a, b, _MM_SHUFFLE(3,1,3,1) ) );
+		//	0 1 4 5 | 2 3 6 7 -> 0 1 2 3 | 4 5 6 7
+		__m256i Out = _mm256_permute4x64_epi64( _mm256_avg_epu8( Even, Odd ), _MM_SHUFFLE(3,1,2,0) );
+		_mm256_storeu_si256( reinterpret_cast<__m256i*>( &Output[p*4] ), Out );
+	}
+
+	HalveRow_Scalar( Row0+p*8, Row1+p*8, Output+p*4, OutputCount-p );
+}
+#endif
+
+
+#if defined(GIF_SIMD_NEON)
+//	4 output pixels at a time, the loads split even & odd pixels for us
+void Gif::HalveRow_Neon(const uint8* Row0,const uint8* Row1,uint8* Output,size_t OutputCount)
+{
+	size_t p = 0;
+	for ( ;	p+4<=OutputCount;	p+=4 )
+	{
+		uint32x4x2_t In0 = vld2q_u32( reinterpret_cast<const uint32*>( &Row0[p*8] ) );
+		uint32x4x2_t In1 = vld2q_u32( reinterpret_cast<const uint32*>( &Row1[p*8] ) );
+		uint8x16_t Even = vrhaddq_u8( vreinterpretq_u8_u32( In0.val[0] ), vreinterpretq_u8_u32( In1.val[0] ) );
+		uint8x16_t Odd = vrhaddq_u8( vreinterpretq_u8_u32( In0.val[1] ), vreinterpretq_u8_u32( In1.val[1] ) );
+		vst1q_u8( &Output[p*4], vrhaddq_u8( Even, Odd ) );
+	}
+
+	HalveRow_Scalar( Row0+p*8, Row1+p*8, Output+p*4, OutputCount-p );
+}
+#endif
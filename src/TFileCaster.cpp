@@ -106,6 +106,11 @@ std::shared_ptr<TMediaMuxer> AllocMuxer(const TCasterParams& Params,std::string
 	{
 		auto AllocGifEncoder = [Input,DeviceParams,Params](size_t StreamIndex,const SoyPixelsMeta& InputMeta)
 		{
+			if ( Params.mGifParams.mCpuOnly )
+			{
+				return Gif::AllocEncoder( Input, StreamIndex, Params.mGifParams, Params.mSkipFrames );
+			}
+
 			if ( DeviceParams.OpenglContext )
 			{
 				return Gif::AllocEncoder( Input, StreamIndex, DeviceParams.OpenglContext, DeviceParams.OpenglTexturePool, Params.mGifParams, Params.mSkipFrames );
@@ -117,10 +122,22 @@ std::shared_ptr<TMediaMuxer> AllocMuxer(const TCasterParams& Params,std::string
 			}
 #endif
 
-			throw Soy::AssertException("Missing graphics context");
+			//	no graphics context (headless), palettise on the cpu
+			return Gif::AllocEncoder( Input, StreamIndex, Params.mGifParams, Params.mSkipFrames );
+		};
+		auto Muxer = std::make_shared<Gif::TMuxer>( Output, Input, Filename, Params.mGifParams );
+
+		//	the muxer makes the encoder resync if it loses a frame
+		std::weak_ptr<Gif::TMuxer> WeakMuxer = Muxer;
+		EncoderFunc = [AllocGifEncoder,WeakMuxer](size_t StreamIndex,const SoyPixelsMeta& InputMeta)
+		{
+			auto Encoder = AllocGifEncoder( StreamIndex, InputMeta );
+			auto Muxer = WeakMuxer.lock();
+			if ( Muxer )
+				Muxer->SetEncoder( Encoder );
+			return Encoder;
 		};
-		EncoderFunc = AllocGifEncoder;
-		return std::make_shared<Gif::TMuxer>( Output, Input, Filename, Params.mGifParams );
+		return Muxer;
 	}
 	
 	if ( Soy::StringEndsWith( Filename, ".raw", false ) )
@@ -28,6 +28,8 @@
 #include <SoyPixels.h>
 #include <string.h>  // for memcpy and bzero
 #include <stdint.h>  // for integer typedefs
+#include <algorithm>
+#include "SoyGifJobPool.h"
 
 typedef Soy::TRgb8 Rgb8;
 typedef Soy::TRgba8 Rgba8;
@@ -251,66 +253,28 @@ void GifGetClosestPaletteColor(GifPalette& Palette, int r, int g, int b, int& be
     }
 }
 
-void GifSwapPixels(uint8_t* image,size_t ChannelCount, int pixA, int pixB)
-{
-	uint8 Temp[10];
-	auto* PtrA = &image[pixA*ChannelCount];
-	auto* PtrB = &image[pixB*ChannelCount];
+// pixels are packed as 0x00rrggbb keys, so partitioning moves one word per pixel whatever the source format was
+inline uint32_t GifPackKey(uint8_t r, uint8_t g, uint8_t b) { return (uint32_t(r) << 16) | (uint32_t(g) << 8) | b; }
+inline int GifKeyChannel(uint32_t key, int com) { return (key >> (16-com*8)) & 0xff; }
 
-	memcpy( Temp, PtrA, ChannelCount );
-	memcpy( PtrA, PtrB, ChannelCount );
-	memcpy( PtrB, Temp, ChannelCount );
-}
+// subtrees with at least this many pixels on both sides are split over the task pool
+const int kGifParallelSplitPixels = 16*1024;
 
-// just the partition operation from quicksort
-int GifPartition(uint8_t* image,size_t ChannelCount,const int left, const int right, const int elt, int pivotIndex)
+// Perform an incomplete sort, finding all elements above and below the desired median.
+// Only the split channel is compared, so it's a masked integer compare
+void GifPartitionByMedian(uint32_t* keys, int numPixels, int com, int neededCenter)
 {
-    const int pivotValue = image[(pivotIndex)*ChannelCount+elt];
-    GifSwapPixels(image, ChannelCount, pivotIndex, right-1);
-    int storeIndex = left;
-    bool split = 0;
-    for(int ii=left; ii<right-1; ++ii)
-    {
-        int arrayVal = image[ii*ChannelCount+elt];
-        if( arrayVal < pivotValue )
-        {
-            GifSwapPixels(image, ChannelCount, ii, storeIndex);
-            ++storeIndex;
-        }
-        else if( arrayVal == pivotValue )
-        {
-            if(split)
-            {
-                GifSwapPixels(image, ChannelCount, ii, storeIndex);
-                ++storeIndex;
-            }
-            split = !split;
-        }
-    }
-    GifSwapPixels(image, ChannelCount, storeIndex, right-1);
-    return storeIndex;
-}
-
-// Perform an incomplete sort, finding all elements above and below the desired median
-void GifPartitionByMedian(uint8_t* image,size_t ChannelCount, int left, int right, int com, int neededCenter)
-{
-    if(left < right-1)
-    {
-        int pivotIndex = left + (right-left)/2;
+    if( neededCenter <= 0 || neededCenter >= numPixels )
+        return;
     
-        pivotIndex = GifPartition(image, ChannelCount, left, right, com, pivotIndex);
-        
-        // Only "sort" the section of the array that contains the median
-        if(pivotIndex > neededCenter)
-            GifPartitionByMedian(image, ChannelCount, left, pivotIndex, com, neededCenter);
-        
-        if(pivotIndex < neededCenter)
-            GifPartitionByMedian(image, ChannelCount, pivotIndex+1, right, com, neededCenter);
-    }
+    const uint32_t mask = 0xffu << (16-com*8);
+    auto Less = [mask](uint32_t a, uint32_t b) { return (a & mask) < (b & mask); };
+    std::nth_element( keys, keys+neededCenter, keys+numPixels, Less );
 }
 
-// Builds a palette by creating a balanced k-d tree of all pixels in the image
-void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firstElt, int lastElt, int splitElt, int splitDist, int treeNode, bool buildForDither,GifPalette& Palette)
+// Builds a palette by creating a balanced k-d tree of all pixels in the image.
+// Subtrees touch separate pixels, palette entries and tree nodes, so big ones can be built in parallel
+void GifSplitPalette(uint32_t* keys, int numPixels, int firstElt, int lastElt, int splitElt, int splitDist, int treeNode, bool buildForDither,GifPalette& Palette,Gif::TTaskPool* Tasks)
 {
     if(lastElt <= firstElt || numPixels == 0)
         return;
@@ -329,9 +293,9 @@ void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firs
                 uint32_t r=255, g=255, b=255;
                 for(int ii=0; ii<numPixels; ++ii)
                 {
-                    r = GifIMin(r, image[ii*ChannelCount+0]);
-                    g = GifIMin(g, image[ii*ChannelCount+1]);
-                    b = GifIMin(b, image[ii*ChannelCount+2]);
+                    r = GifIMin(r, GifKeyChannel(keys[ii], 0));
+                    g = GifIMin(g, GifKeyChannel(keys[ii], 1));
+                    b = GifIMin(b, GifKeyChannel(keys[ii], 2));
                 }
 				
 				Palette.SetColour( firstElt, Rgb8(r,g,b) );
@@ -345,9 +309,9 @@ void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firs
                 uint32_t r=0, g=0, b=0;
                 for(int ii=0; ii<numPixels; ++ii)
                 {
-                    r = GifIMax(r, image[ii*ChannelCount+0]);
-                    g = GifIMax(g, image[ii*ChannelCount+1]);
-                    b = GifIMax(b, image[ii*ChannelCount+2]);
+                    r = GifIMax(r, GifKeyChannel(keys[ii], 0));
+                    g = GifIMax(g, GifKeyChannel(keys[ii], 1));
+                    b = GifIMax(b, GifKeyChannel(keys[ii], 2));
                 }
 				
 				Palette.SetColour( firstElt, Rgb8(r,g,b) );
@@ -360,9 +324,9 @@ void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firs
         uint64_t r=0, g=0, b=0;
         for(int ii=0; ii<numPixels; ++ii)
         {
-            r += image[ii*ChannelCount+0];
-            g += image[ii*ChannelCount+1];
-            b += image[ii*ChannelCount+2];
+            r += GifKeyChannel(keys[ii], 0);
+            g += GifKeyChannel(keys[ii], 1);
+            b += GifKeyChannel(keys[ii], 2);
         }
         
         r += numPixels / 2;  // round to nearest
@@ -384,9 +348,9 @@ void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firs
     int minB = 255, maxB = 0;
     for(int ii=0; ii<numPixels; ++ii)
     {
-        int r = image[ii*ChannelCount+0];
-        int g = image[ii*ChannelCount+1];
-        int b = image[ii*ChannelCount+2];
+        int r = GifKeyChannel(keys[ii], 0);
+        int g = GifKeyChannel(keys[ii], 1);
+        int b = GifKeyChannel(keys[ii], 2);
         
         if(r > maxR) maxR = r;
         if(r < minR) minR = r;
@@ -410,13 +374,33 @@ void GifSplitPalette(uint8_t* image,size_t ChannelCount, int numPixels, int firs
     int subPixelsA = numPixels * (splitElt - firstElt) / (lastElt - firstElt);
     int subPixelsB = numPixels-subPixelsA;
     
-    GifPartitionByMedian(image, ChannelCount, 0, numPixels, splitCom, subPixelsA);
+    GifPartitionByMedian(keys, numPixels, splitCom, subPixelsA);
     
     Palette.treeSplitElt[treeNode] = splitCom;
-    Palette.treeSplit[treeNode] = image[subPixelsA*ChannelCount+splitCom];
+    Palette.treeSplit[treeNode] = GifKeyChannel(keys[GifIMin(subPixelsA, numPixels-1)], splitCom);
+    
+    auto SplitA = [=,&Palette]
+    {
+        GifSplitPalette(keys, subPixelsA, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2, buildForDither, Palette, Tasks );
+    };
+    auto SplitB = [=,&Palette]
+    {
+        GifSplitPalette(keys+subPixelsA, subPixelsB, splitElt, lastElt, splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, Palette, Tasks );
+    };
+    
+    bool Parallel = Tasks && Tasks->GetWorkerCount() > 0 && subPixelsA >= kGifParallelSplitPixels && subPixelsB >= kGifParallelSplitPixels;
+    if( !Parallel )
+    {
+        SplitA();
+        SplitB();
+        return;
+    }
     
-    GifSplitPalette(image, ChannelCount,          subPixelsA, firstElt, splitElt, splitElt-splitDist, splitDist/2, treeNode*2,   buildForDither, Palette );
-    GifSplitPalette(image+subPixelsA*ChannelCount, ChannelCount, subPixelsB, splitElt, lastElt,  splitElt+splitDist, splitDist/2, treeNode*2+1, buildForDither, Palette );
+    // we run the newest (B) while waiting, a worker picks up A
+    Gif::TTaskPool::TGroup Group;
+    Tasks->Push( Group, SplitA );
+    Tasks->Push( Group, SplitB );
+    Tasks->Wait( Group );
 }
 
 void GifMakeDiffPalette(const SoyPixelsImpl& PrevIndexes,const SoyPixelsImpl& PrevPalette,const uint8_t* frame_rgba, uint32_t width, uint32_t height,SoyPixelsImpl& Palette)
@@ -481,29 +465,35 @@ void GifDebugPalette(SoyPixelsImpl& Palette)
 
 
 // Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
-// This is known as the "modified median split" technique
-void GifMakePalette(const SoyPixelsImpl& BigPalette,bool buildForDither,std::shared_ptr<GifPalette>& pPalette,size_t PaletteSize)
+// This is known as the "modified median split" technique. Tasks (optional) builds big subtrees in parallel
+void GifMakePalette(const SoyPixelsImpl& BigPalette,bool buildForDither,std::shared_ptr<GifPalette>& pPalette,size_t PaletteSize,Gif::TTaskPool* Tasks=nullptr)
 {
-	//	gr: this is flexible now?
-	Soy::Assert( BigPalette.GetFormat()==SoyPixelsFormat::RGBA, "Expecting palette in RGBA");
+	Gif::TPixelLayout Layout( BigPalette.GetFormat() );
 
 	pPalette.reset( new GifPalette(PaletteSize) );
 	auto& SmallPalette = *pPalette;
 	
 	// SplitPalette is destructive (it sorts the pixels by color) so
-	// we must create a copy of the image for it to destroy
-	Array<uint8> destroyableImage;
-	destroyableImage.Copy( BigPalette.GetPixelsArray() );
-	auto* pData = destroyableImage.GetArray();
+	// we pack them into keys for it to destroy. Reused per thread
+	static thread_local Array<uint32_t> destroyableKeys;
+	auto PixelCount = BigPalette.GetWidth() * BigPalette.GetHeight();
+	destroyableKeys.SetSize( PixelCount );
+	auto* pKeys = destroyableKeys.GetArray();
+	auto* Pixels = BigPalette.GetPixelsArray().GetArray();
+	for ( size_t i=0;	i<PixelCount;	i++ )
+	{
+		auto* Pixel = &Pixels[i*Layout.mChannels];
+		pKeys[i] = GifPackKey( Pixel[Layout.mRed], Pixel[Layout.mGreen], Pixel[Layout.mBlue] );
+	}
 	
 	int firstElement = 0;
 	const int lastElt = size_cast<int>(SmallPalette.GetSize());
 	const int splitElt = lastElt/2;
 	const int splitDist = splitElt/2;
-	int numPixels = size_cast<int>(BigPalette.GetWidth());
+	int numPixels = size_cast<int>(PixelCount);
 	int treeNode = 1;
 	
-	GifSplitPalette( pData, BigPalette.GetChannels(), numPixels, firstElement, lastElt, splitElt, splitDist, treeNode, buildForDither, SmallPalette );
+	GifSplitPalette( pKeys, numPixels, firstElement, lastElt, splitElt, splitDist, treeNode, buildForDither, SmallPalette, Tasks );
 	
 	
 	// add the bottom node for the transparency index
@@ -512,6 +502,136 @@ void GifMakePalette(const SoyPixelsImpl& BigPalette,bool buildForDither,std::sha
 	SmallPalette.treeSplitElt[SmallPalette.GetSize()>>1] = 0;
 }
 
+// one bin of the colour histogram; count and colour sums (for the mean colour of the pixels that fell in it)
+struct GifHistogramBin
+{
+    uint32_t count;
+    uint32_t sum[3];
+    uint8_t  mean[3];
+};
+
+// weighted median cut over histogram bins. Splits the widest axis so each side gets a share of
+// the colours proportional to its pixel count, leaves are the count-weighted average colour.
+void GifSplitHistogram(GifHistogramBin* bins, size_t binCount, size_t colourCount, ArrayBridge<Rgb8>& colours)
+{
+    if( binCount == 0 || colourCount == 0 )
+        return;
+    
+    // enough colours for every bin, or a single colour for all of them
+    if( binCount <= colourCount || colourCount == 1 )
+    {
+        size_t leafCount = (binCount <= colourCount) ? 1 : binCount;
+        for( size_t first=0; first<binCount; first+=leafCount )
+        {
+            uint64_t count = 0, r = 0, g = 0, b = 0;
+            for( size_t ii=first; ii<first+leafCount; ++ii )
+            {
+                count += bins[ii].count;
+                r += bins[ii].sum[0];
+                g += bins[ii].sum[1];
+                b += bins[ii].sum[2];
+            }
+            auto Mean = [count](uint64_t Sum)   {   return static_cast<uint8_t>( (Sum + count/2) / count );   };
+            colours.PushBack( Rgb8( Mean(r), Mean(g), Mean(b) ) );
+        }
+        return;
+    }
+    
+    // find the axis with the largest range
+    int minC[3] = { 255, 255, 255 };
+    int maxC[3] = { 0, 0, 0 };
+    uint64_t totalCount = 0;
+    for( size_t ii=0; ii<binCount; ++ii )
+    {
+        for( int c=0; c<3; ++c )
+        {
+            minC[c] = GifIMin( minC[c], bins[ii].mean[c] );
+            maxC[c] = GifIMax( maxC[c], bins[ii].mean[c] );
+        }
+        totalCount += bins[ii].count;
+    }
+    int splitCom = 1;
+    if( maxC[2]-minC[2] > maxC[1]-minC[1] ) splitCom = 2;
+    if( maxC[0]-minC[0] > maxC[2]-minC[2] && maxC[0]-minC[0] > maxC[1]-minC[1] ) splitCom = 0;
+    
+    std::sort( bins, bins+binCount, [splitCom](const GifHistogramBin& a,const GifHistogramBin& b)
+    {
+        return a.mean[splitCom] < b.mean[splitCom];
+    });
+    
+    // split where the running count reaches the left half's share
+    size_t colourCountA = colourCount / 2;
+    uint64_t targetCount = totalCount * colourCountA / colourCount;
+    uint64_t runningCount = 0;
+    size_t splitBin = 0;
+    while( splitBin < binCount && runningCount + bins[splitBin].count <= targetCount )
+        runningCount += bins[splitBin++].count;
+    
+    // both sides need at least one bin
+    splitBin = std::min( std::max<size_t>( splitBin, 1 ), binCount-1 );
+    
+    GifSplitHistogram( bins, splitBin, colourCountA, colours );
+    GifSplitHistogram( bins+splitBin, binCount-splitBin, colourCount-colourCountA, colours );
+}
+
+// Accumulates the (opaque) pixels of an RGB(A)/BGR(A) image into a 2^(bits*3) colour histogram and median cuts the occupied bins
+// into at most MaxColours colours. After the one pass over the pixels, cost depends on the number of occupied bins, not resolution.
+void GifMakeHistogramPalette(const SoyPixelsImpl& Rgba,size_t PixelSkip,size_t Bits,size_t MaxColours,ArrayBridge<Rgb8>&& Colours)
+{
+    Gif::TPixelLayout Layout( Rgba.GetFormat() );
+    Soy::Assert( Bits >= 4 && Bits <= 6, "GifMakeHistogramPalette bits should be 4-6" );
+    
+    // reused per thread, only touched bins are cleared afterwards
+    static thread_local Array<GifHistogramBin> Histogram;
+    static thread_local Array<uint32_t> Occupied;
+    size_t BinCount = 1 << (Bits*3);
+    if( Histogram.GetSize() != BinCount )
+    {
+        Histogram.SetSize( BinCount );
+        memset( Histogram.GetArray(), 0, Histogram.GetDataSize() );
+    }
+    Occupied.Clear(false);
+    
+    auto Shift = 8 - Bits;
+    auto* Bins = Histogram.GetArray();
+    auto* Pixels = Rgba.GetPixelsArray().GetArray();
+    auto PixelCount = Rgba.GetWidth() * Rgba.GetHeight();
+    auto PixelStep = 1 + PixelSkip;
+    for( size_t ii=0; ii<PixelCount; ii+=PixelStep )
+    {
+        auto* Pixel = &Pixels[ii*Layout.mChannels];
+        if( Layout.mHasAlpha && Pixel[3] == 0 )
+            continue;
+        
+        uint8_t r = Pixel[Layout.mRed];
+        uint8_t g = Pixel[Layout.mGreen];
+        uint8_t b = Pixel[Layout.mBlue];
+        uint32_t Bin = ((r >> Shift) << (Bits*2)) | ((g >> Shift) << Bits) | (b >> Shift);
+        auto& HistogramBin = Bins[Bin];
+        if( HistogramBin.count++ == 0 )
+            Occupied.PushBack( Bin );
+        HistogramBin.sum[0] += r;
+        HistogramBin.sum[1] += g;
+        HistogramBin.sum[2] += b;
+    }
+    
+    // compact the occupied bins (clearing the histogram as we go)
+    Array<GifHistogramBin> Entries;
+    Entries.SetSize( Occupied.GetSize() );
+    for( size_t ii=0; ii<Occupied.GetSize(); ++ii )
+    {
+        auto& HistogramBin = Bins[Occupied[ii]];
+        auto& Entry = Entries[ii];
+        Entry = HistogramBin;
+        for( int c=0; c<3; ++c )
+            Entry.mean[c] = static_cast<uint8_t>( Entry.sum[c] / Entry.count );
+        memset( &HistogramBin, 0, sizeof(HistogramBin) );
+    }
+    
+    Colours.Clear(false);
+    GifSplitHistogram( Entries.GetArray(), Entries.GetSize(), MaxColours, Colours );
+}
+
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
 void GifDitherImage(SoyPixelsImpl* LastIndexes,SoyPixelsImpl* LastPalette,const uint8_t* nextFrame,SoyPixelsImpl& OutImage, uint32_t width, uint32_t height, GifPalette& Palette )
 {
@@ -671,65 +791,172 @@ void GifThresholdImage(SoyPixelsImpl* LastIndexes,SoyPixelsImpl* LastPalette,con
 	}
 }
 
-// Simple structure to write out the LZW-compressed portion of the image
-// one bit at a time
-struct GifBitStatus
+// Packs LZW codes (lsb first) into a 64 bit accumulator and flushes whole bytes straight into
+// 255-byte sub-blocks of a small fixed buffer, which goes to the writer whenever it can't fit another whole block
+struct GifBitWriter
 {
-    uint8_t bitIndex;  // how many bits in the partial byte written so far
-    uint8_t byte;      // current partial byte
+    static const size_t BufferSize = 256 * 16;
     
-    uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
-};
-
-// insert a single bit
-void GifWriteBit( GifBitStatus& stat, uint32_t bit )
-{
-    bit = bit & 1;
-    bit = bit << stat.bitIndex;
-    stat.byte |= bit;
-    
-    ++stat.bitIndex;
-    if( stat.bitIndex > 7 )
-    {
-        // move the newly-finished byte to the chunk buffer 
-        stat.chunk[stat.chunkIndex++] = stat.byte;
-        // and start a new byte
-        stat.bitIndex = 0;
-        stat.byte = 0;
+    GifBitWriter(GifWriter& Writer) :
+        writer( Writer )
+    {
+        bits = 0;
+        bitCount = 0;
+        pos = 0;
+        StartBlock();
     }
-}
-
-// write all bytes so far to the file
-void GifWriteChunk(GifWriter& Writer, GifBitStatus& stat )
-{
-    Writer.fputc(stat.chunkIndex);
-    Writer.fwrite(stat.chunk, stat.chunkIndex);
     
-    stat.bitIndex = 0;
-    stat.byte = 0;
-    stat.chunkIndex = 0;
-}
-
-void GifWriteCode(GifWriter& Writer, GifBitStatus& stat, uint32_t code, uint32_t length )
-{
-    for( uint32_t ii=0; ii<length; ++ii )
+    inline void WriteCode( uint32_t code, uint32_t length )
     {
-        GifWriteBit(stat, code);
-        code = code >> 1;
+        // only the low length bits are written
+        code &= (1u << length) - 1;
+        bits |= static_cast<uint64_t>(code) << bitCount;
+        bitCount += length;
         
-        if( stat.chunkIndex == 255 )
+        // length is at most 12, so <32 bits are pending going in and we never overflow 64
+        if( bitCount >= 32 )
         {
-            GifWriteChunk( Writer, stat);
+            auto Word = static_cast<uint32_t>(bits);
+            if( blockSize + 4 <= 255 )
+            {
+                uint8_t* Out = &data[pos];
+                Out[0] = static_cast<uint8_t>(Word);
+                Out[1] = static_cast<uint8_t>(Word >> 8);
+                Out[2] = static_cast<uint8_t>(Word >> 16);
+                Out[3] = static_cast<uint8_t>(Word >> 24);
+                pos += 4;
+                blockSize += 4;
+            }
+            else
+            {
+                PutByte( static_cast<uint8_t>(Word) );
+                PutByte( static_cast<uint8_t>(Word >> 8) );
+                PutByte( static_cast<uint8_t>(Word >> 16) );
+                PutByte( static_cast<uint8_t>(Word >> 24) );
+            }
+            bits >>= 32;
+            bitCount -= 32;
         }
     }
-}
+    
+    // pad the last partial byte with zeros, close the last sub-block and write out what's left
+    void Finish()
+    {
+        while( bitCount > 0 )
+        {
+            PutByte( static_cast<uint8_t>(bits) );
+            bits >>= 8;
+            bitCount = bitCount > 8 ? bitCount-8 : 0;
+        }
+        
+        // drop an empty trailing block header
+        if( blockSize == 0 )
+            pos = blockStart;
+        else
+            data[blockStart] = static_cast<uint8_t>(blockSize);
+        
+        if( pos > 0 )
+            writer.fwrite( data, pos );
+        pos = 0;
+    }
+    
+private:
+    inline void PutByte( uint8_t Byte )
+    {
+        if( blockSize == 255 )
+        {
+            data[blockStart] = 255;
+            StartBlock();
+        }
+        data[pos++] = Byte;
+        blockSize++;
+    }
+    
+    inline void StartBlock()
+    {
+        // everything before here is whole blocks. Make sure there's room for a full one after the length byte
+        if( pos + 256 > BufferSize )
+        {
+            writer.fwrite( data, pos );
+            pos = 0;
+        }
+        blockStart = pos;
+        data[pos++] = 0;   // length, filled in when the block is closed
+        blockSize = 0;
+    }
+    
+private:
+    uint64_t        bits;       // pending bits, lsb first
+    uint32_t        bitCount;
+    GifWriter&      writer;
+    uint8_t         data[BufferSize];
+    size_t          pos;
+    size_t          blockStart; // position of the current sub-block's length byte
+    uint32_t        blockSize;
+};
 
-// The LZW dictionary is a 256-ary tree constructed as the file is encoded,
-// this is one node
-struct GifLzwNode
+// The LZW dictionary maps (prefix code, next index) -> code. It's an open-addressed hash table
+// (4096 codes max in 8192 slots) rather than a 256-ary tree (2mb per image), so it stays in L2.
+// Slots are stamped with a generation, clearing the dictionary just bumps the generation.
+// One per thread, reused for every image.
+struct GifLzwDictionary
 {
-    uint16_t m_next[256];
+    static const uint32_t SlotBits = 13;
+    static const uint32_t SlotCount = 1 << SlotBits;
+    
+    GifLzwDictionary()
+    {
+        generation = 0;
+        memset( generations, 0, sizeof(generations) );
+        Clear();
+    }
+    
+    inline void Clear()
+    {
+        generation++;
+        // wrapped, stamps from 65535 generations ago would look current
+        if( generation == 0 )
+        {
+            memset( generations, 0, sizeof(generations) );
+            generation = 1;
+        }
+    }
+    
+    // returns 0 if not in the dictionary (codes 0..clearCode+1 are never entries)
+    inline uint16_t Find( uint32_t prefix, uint8_t value ) const
+    {
+        uint32_t key = (prefix << 8) | value;
+        for( uint32_t slot = GetSlot(key); ; slot = (slot+1) & (SlotCount-1) )
+        {
+            if( generations[slot] != generation )
+                return 0;
+            if( (entries[slot] >> 12) == key )
+                return static_cast<uint16_t>( entries[slot] & 0xfff );
+        }
+    }
+    
+    inline void Insert( uint32_t prefix, uint8_t value, uint32_t code )
+    {
+        uint32_t key = (prefix << 8) | value;
+        uint32_t slot = GetSlot(key);
+        while( generations[slot] == generation )
+            slot = (slot+1) & (SlotCount-1);
+        
+        generations[slot] = generation;
+        entries[slot] = (key << 12) | code;
+    }
+    
+private:
+    static inline uint32_t GetSlot( uint32_t key )
+    {
+        // fibonacci hash of the 20 bit key
+        return (key * 2654435761u) >> (32 - SlotBits);
+    }
+    
+private:
+    uint16_t    generation;
+    uint16_t    generations[SlotCount];
+    uint32_t    entries[SlotCount];     // key (12 bit prefix, 8 bit value) << 12 | 12 bit code
 };
 
 void GifWritePalette( const SoyPixelsImpl& Palette,size_t PaddedPaletteSize,GifWriter& Writer)
@@ -752,8 +979,102 @@ void GifWritePalette( const SoyPixelsImpl& Palette,size_t PaddedPaletteSize,GifW
 	}
 }
 
+// colour tables are a power of 2, and lzw needs a min code size of 2, so at least 4 entries
+uint32 GifGetPaddedPaletteSize(size_t PaletteSize)
+{
+	uint32 PaddedPaletteSize = size_cast<uint32>( PaletteSize );
+	PaddedPaletteSize = isPowerOfTwo( PaddedPaletteSize ) ? PaddedPaletteSize : GetNextPowerOfTwo( PaddedPaletteSize );
+	return std::max<uint32>( PaddedPaletteSize, 4 );
+}
+
+uint32 GifGetPaddedPaletteSize(const SoyPixelsImpl& Palette)
+{
+	return GifGetPaddedPaletteSize( Palette.GetWidth() );
+}
+
+// flags every index the image uses, returns the highest
+size_t GifGetUsedIndexes(const SoyPixelsImpl& Image,bool Used[256])
+{
+	std::fill( Used, Used+256, false );
+	auto& Indexes = Image.GetPixelsArray();
+	auto* Pixels = Indexes.GetArray();
+	size_t PixelCount = Indexes.GetSize();
+	size_t MaxIndex = 0;
+	for ( size_t i=0;	i<PixelCount;	i++ )
+		Used[Pixels[i]] = true;
+	for ( size_t i=0;	i<256;	i++ )
+		MaxIndex = Used[i] ? i : MaxIndex;
+	return MaxIndex;
+}
+
+// lzw codes start one bit wider than this, so it only has to cover the indexes actually written, not the colour table
+uint8 GifGetMinCodeSize(size_t MaxIndex)
+{
+	uint8 MinCodeSize = 2;
+	while ( (1u << MinCodeSize) <= MaxIndex )
+		MinCodeSize++;
+	return MinCodeSize;
+}
+
+// copy the colours the image uses to the front of a new palette and remap the indexes to match, so the frame can have a
+// local colour table (and codes) as small as it allows. Entries up to the transparent index stay where they are.
+// A frame on the global table only swaps when the smaller codes should pay for writing its own table.
+// false (and nothing changed) if it's not worth it. Either way MaxIndex is the highest index the image now uses (or the
+// transparent index), to pass to GifWriteLzwImage
+bool GifCompactPalette(SoyPixelsImpl& CompactPalette,SoyPixelsImpl& Image,const SoyPixelsImpl& Palette,uint8 TransparentIndex,bool IsGlobalPalette,size_t& MaxIndex)
+{
+	//	lzw writes fewer codes than pixels, this is a guess at how many fewer for a frame worth swapping
+	static size_t PixelsPerCode = 4;
+
+	bool Used[256];
+	MaxIndex = std::max<size_t>( GifGetUsedIndexes( Image, Used ), TransparentIndex );
+
+	uint8 Remap[256];
+	size_t CompactSize = 0;
+	for ( size_t i=0;	i<256;	i++ )
+	{
+		if ( i > TransparentIndex && !Used[i] )
+			continue;
+		Remap[i] = size_cast<uint8>( CompactSize++ );
+	}
+	CompactSize = std::min( CompactSize, Palette.GetWidth() );
+
+	auto CompactPaddedSize = GifGetPaddedPaletteSize( CompactSize );
+	if ( IsGlobalPalette )
+	{
+		auto CodeBitsSaved = GifGetMinCodeSize( MaxIndex ) - GifGetMinCodeSize( CompactSize-1 );
+		auto CodeBytesSaved = Image.GetPixelsArray().GetSize() / PixelsPerCode * CodeBitsSaved / 8;
+		if ( CodeBytesSaved <= CompactPaddedSize * 3 )
+			return false;
+	}
+	else if ( CompactPaddedSize >= GifGetPaddedPaletteSize( Palette ) )
+	{
+		return false;
+	}
+
+	CompactPalette.Init( SoyPixelsMeta( CompactSize, 1, Palette.GetFormat() ) );
+	auto Channels = Palette.GetChannels();
+	auto* PalettePixels = Palette.GetPixelsArray().GetArray();
+	auto* CompactPixels = CompactPalette.GetPixelsArray().GetArray();
+	for ( size_t i=0;	i<Palette.GetWidth();	i++ )
+	{
+		if ( i > TransparentIndex && !Used[i] )
+			continue;
+		memcpy( &CompactPixels[Remap[i]*Channels], &PalettePixels[i*Channels], Channels );
+	}
+
+	auto& Indexes = Image.GetPixelsArray();
+	auto* Pixels = Indexes.GetArray();
+	for ( size_t i=0;	i<Indexes.GetSize();	i++ )
+		Pixels[i] = Remap[Pixels[i]];
+	MaxIndex = Remap[MaxIndex];
+	return true;
+}
+
 // write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left, uint16 top,uint16 delay,const SoyPixelsImpl& Palette,uint8 TransparentIndex,bool Compress)
+// if LocalPalette is false, Palette is the global colour table from GifBegin
+// MaxIndex is the highest index in the image (or the transparent index, if higher), as GifCompactPalette gives
+void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left, uint16 top,uint16 delay,const SoyPixelsImpl& Palette,bool LocalPalette,uint8 TransparentIndex,size_t MaxIndex,bool Compress)
 {
 	Soy::Assert( Image.GetFormat()==SoyPixelsFormat::Greyscale, "Expecting palette-index iamge format");
 	auto width = size_cast<uint16>( Image.GetWidth() );
@@ -785,30 +1106,33 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
     //fputc(0x80); // no local color table, but transparency
 	
 	//	pallette size needs to be power2 aligned
-	uint32 PaddedPaletteSize = size_cast<uint32>( Palette.GetWidth() );
-	PaddedPaletteSize = isPowerOfTwo( PaddedPaletteSize ) ? PaddedPaletteSize : GetNextPowerOfTwo( PaddedPaletteSize );
+	uint32 PaddedPaletteSize = GifGetPaddedPaletteSize( Palette );
 	
-    Writer.fputc(0x80 + GetBitIndex(PaddedPaletteSize) - 1); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette( Palette, PaddedPaletteSize, Writer );
+	if ( LocalPalette )
+	{
+		Writer.fputc(0x80 + GetBitIndex(PaddedPaletteSize) - 1); // local color table present, 2 ^ bitDepth entries
+		GifWritePalette( Palette, PaddedPaletteSize, Writer );
+	}
+	else
+	{
+		Writer.fputc(0); // no local color table
+	}
     
-	auto minCodeSize = size_cast<uint8>( GetBitIndex(PaddedPaletteSize) );
-	const uint32_t clearCode = size_cast<const uint32_t>( PaddedPaletteSize );
+	//	codes only need to cover the indexes this frame uses
+	auto minCodeSize = GifGetMinCodeSize( MaxIndex );
+	const uint32_t clearCode = 1u << minCodeSize;
 	
-    Writer.fputc(minCodeSize); // min code size 8 bits
-    
-    GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
+    Writer.fputc(minCodeSize);
     
-    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+    static thread_local GifLzwDictionary codetree;
+    codetree.Clear();
     int32_t curCode = -1;
     uint32_t codeSize = minCodeSize+1;
     uint32_t maxCode = clearCode+1;
     
-    GifBitStatus stat;
-    stat.byte = 0;
-    stat.bitIndex = 0;
-    stat.chunkIndex = 0;
+    GifBitWriter stat( Writer );
     
-    GifWriteCode(Writer,stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    stat.WriteCode( clearCode, codeSize );  // start with a fresh LZW dictionary
 	
 	auto& Indexes = Image.GetPixelsArray();
 	
@@ -821,8 +1145,8 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
 			// "loser mode" - no compression, every single code is followed immediately by a clear
 			if ( !Compress )
 			{
-				GifWriteCode( Writer, stat, nextValue, codeSize );
-				GifWriteCode( Writer, stat, 256, codeSize );
+				stat.WriteCode( nextValue, codeSize );
+				stat.WriteCode( clearCode, codeSize );
 				//WriteCode(f, stat, nextValue, codeSize);
 				//WriteCode(f, stat, 256, codeSize);
 				continue;
@@ -834,18 +1158,18 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
                 // first value in a new run
                 curCode = nextValue;
             }
-            else if( codetree[curCode].m_next[nextValue] )
+            else if( auto nextCode = codetree.Find( curCode, nextValue ) )
             {
                 // current run already in the dictionary
-                curCode = codetree[curCode].m_next[nextValue];
+                curCode = nextCode;
             }
             else
             {
                 // finish the current run, write a code
-                GifWriteCode( Writer, stat, curCode, codeSize );
+                stat.WriteCode( curCode, codeSize );
                 
                 // insert the new run into the dictionary
-                codetree[curCode].m_next[nextValue] = ++maxCode;
+                codetree.Insert( curCode, nextValue, ++maxCode );
                 
                 if( maxCode >= (1ul << codeSize) )
                 {
@@ -856,9 +1180,9 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(Writer, stat, clearCode, codeSize); // clear tree
+                    stat.WriteCode( clearCode, codeSize ); // clear tree
                     
-                    memset(codetree, 0, sizeof(GifLzwNode)*4096);
+                    codetree.Clear();
                     curCode = -1;
                     codeSize = minCodeSize+1;
                     maxCode = clearCode+1;
@@ -869,20 +1193,16 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
         }
     }
     
-    // compression footer
-    GifWriteCode( Writer, stat, curCode, codeSize );
-    GifWriteCode( Writer, stat, clearCode, codeSize );
-    GifWriteCode( Writer, stat, clearCode+1, minCodeSize+1 );
+    // compression footer (loser mode has no run left over)
+    if( curCode >= 0 )
+        stat.WriteCode( curCode, codeSize );
+    stat.WriteCode( clearCode, codeSize );
+    stat.WriteCode( clearCode+1, minCodeSize+1 );
     
-    // write out the last partial chunk
-    while( stat.bitIndex ) 
-		GifWriteBit(stat, 0);
-    if( stat.chunkIndex ) 
-		GifWriteChunk(Writer, stat);
+    // write out the last partial byte & sub-block
+    stat.Finish();
     
 	Writer.fputc(0); // image block terminator
-    
-    GIF_TEMP_FREE(codetree);
 }
 
 
@@ -890,7 +1210,8 @@ void GifWriteLzwImage(GifWriter& Writer,const SoyPixelsImpl& Image, uint16 left,
 // Creates a gif file.
 // The input GIFWriter is assumed to be uninitialized.
 // The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
-bool GifBegin( GifWriter& writer, uint16 width, uint16 height,uint16 LoopCount)
+// GlobalPalette is optional, without it a dummy 2 colour table is written and every frame needs a local one
+bool GifBegin( GifWriter& writer, uint16 width, uint16 height,uint16 LoopCount,const SoyPixelsImpl* GlobalPalette)
 {
 	writer.Open();
 	
@@ -902,19 +1223,30 @@ bool GifBegin( GifWriter& writer, uint16 width, uint16 height,uint16 LoopCount)
     writer.fputc(height & 0xff);
     writer.fputc((height >> 8) & 0xff);
     
-    writer.fputc(0xf0);  // there is an unsorted global color table of 2 entries
-    writer.fputc(0);     // background color
-    writer.fputc(0);     // pixels are square (we need to specify this because it's 1989)
-    
-    // now the "global" palette (really just a dummy palette)
-    // color 0: black
-    writer.fputc(0);
-    writer.fputc(0);
-    writer.fputc(0);
-    // color 1: also black
-    writer.fputc(0);
-    writer.fputc(0);
-    writer.fputc(0);
+    if ( GlobalPalette )
+    {
+        uint32 PaddedPaletteSize = GifGetPaddedPaletteSize( *GlobalPalette );
+        writer.fputc(0xf0 + GetBitIndex(PaddedPaletteSize) - 1);  // unsorted global color table, 2 ^ bitDepth entries
+        writer.fputc(0);     // background color
+        writer.fputc(0);     // pixels are square
+        GifWritePalette( *GlobalPalette, PaddedPaletteSize, writer );
+    }
+    else
+    {
+        writer.fputc(0xf0);  // there is an unsorted global color table of 2 entries
+        writer.fputc(0);     // background color
+        writer.fputc(0);     // pixels are square (we need to specify this because it's 1989)
+    
+        // now the "global" palette (really just a dummy palette)
+        // color 0: black
+        writer.fputc(0);
+        writer.fputc(0);
+        writer.fputc(0);
+        // color 1: also black
+        writer.fputc(0);
+        writer.fputc(0);
+        writer.fputc(0);
+    }
 	
 	//	gr: currently always including animation header.
     {